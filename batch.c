@@ -0,0 +1,418 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Process many ELF files in a single invocation, using a pool of workers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "closure.h"
+#include "stats.h"
+
+typedef struct
+{
+    char *out;
+    char *err;
+    char *plan;
+    char *copy;     /* The patched copy, replacing the file once all the copies are flushed */
+    size_t outlen;
+    size_t errlen;
+    size_t planlen;
+    dev_t dev;
+    int rv;
+    int done;
+} Task;
+
+typedef struct
+{
+    const LD_Cache *ldcache;
+    const char *const *files;
+    const Batch_Options *options;
+    Closure_Memo *memo;
+    Task *tasks;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} Pool;
+
+static void run_task(const Pool *pool, LD_Cache *ldcache, size_t k)
+{
+    const Batch_Options *options = pool->options;
+    const char *filename = pool->files[k];
+    Task *task = &pool->tasks[k];
+    struct stat stats;
+    FILE *out, *err, *plan = NULL;
+
+    /* Buffer the outputs of the file, so that they can be printed in order */
+    if ((out = open_memstream(&task->out, &task->outlen)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the output buffer for %s: %s!\n", filename, strerror(errno));
+        task->rv = 3;
+        return;
+    }
+    if ((err = open_memstream(&task->err, &task->errlen)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the output buffer for %s: %s!\n", filename, strerror(errno));
+        fclose(out);
+        task->rv = 3;
+        return;
+    }
+    if (options->plan != NULL && (plan = open_memstream(&task->plan, &task->planlen)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the output buffer for %s: %s!\n", filename, strerror(errno));
+        fclose(out);
+        fclose(err);
+        task->rv = 3;
+        return;
+    }
+
+    if (stats_enabled)
+        stats_begin();
+
+    /* The missing libraries are only gathered, the plan is written once all the files are read */
+    if (options->repair == RP_PLAN)
+        task->rv = repair_gather(ldcache, options->index, filename, &options->repairs[k], err);
+    /* The files are only indexed, the dependents are looked up once they all are */
+    else if (options->query == QU_DEPENDENTS)
+        task->rv = scanindex_update(options->index, filename, err);
+    /* The raw query results need to be attributed to their file */
+    else if (options->query != QU_NOTHING)
+    {
+        /* The objects already hold the name of their file */
+        if (options->format == FMT_TEXT)
+            fprintf(out, "%s:\n", filename);
+        if (options->query == QU_CLOSURE)
+            task->rv = closure_query(ldcache, pool->memo, filename, options->format, out, err);
+        else
+            task->rv = dynamics_query(ldcache, options->index, filename, options->query, options->format, out, err);
+    }
+    else
+    {
+        /* The files replaced atomically are flushed all at once, at the end */
+        task->rv = dynamics_process(ldcache, options->priority, filename, NULL,
+                                    options->repair == RP_APPLY ? options->repairs[k].replacements : options->replacements,
+                                    options->soname, options->rpath, options->fix,
+                                    options->mode == WR_ATOMIC ? WR_ATOMIC_LAZY : options->mode, &task->copy, plan, out, err);
+        if (task->copy != NULL)
+        {
+            if (stat(task->copy, &stats) == 0)
+                task->dev = stats.st_dev;
+            else
+            {
+                fprintf(err, "Failed to read the stats of the copy of %s: %s!\n", filename, strerror(errno));
+                unlink(task->copy);
+                free(task->copy);
+                task->copy = NULL;
+                task->rv = 4;
+            }
+        }
+    }
+
+    if (stats_enabled)
+        stats_end(filename, err);
+
+    fclose(out);
+    fclose(err);
+    if (plan != NULL)
+        fclose(plan);
+}
+
+static void* worker(void *arg)
+{
+    Pool *pool = arg;
+    LD_Cache view, *ldcache = NULL;
+    size_t k;
+
+    /* The cache entries are shared, but each worker has its own search paths */
+    if (pool->ldcache != NULL)
+    {
+        view = *pool->ldcache;
+        view.paths = NULL;
+        view.pathlen = 0;
+        ldcache = &view;
+    }
+
+    for (;;)
+    {
+        /* Pick the next file to process */
+        pthread_mutex_lock(&pool->lock);
+        k = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (k >= pool->count)
+            break;
+
+        run_task(pool, ldcache, k);
+
+        if (ldcache != NULL)
+            ldcache_clearpath(ldcache);
+
+        /* Notify the printer */
+        pthread_mutex_lock(&pool->lock);
+        pool->tasks[k].done = 1;
+        pthread_cond_broadcast(&pool->ready);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+/* A filesystem of the copies, flushed once */
+typedef struct
+{
+    dev_t dev;
+    int flushed;
+} Filesystem;
+
+static int compare_directories(const void *a, const void *b)
+{
+    const char *pa = *(const char *const*)a, *pb = *(const char *const*)b;
+    const size_t la = strrchr(pa, '/') - pa, lb = strrchr(pb, '/') - pb;
+    const int c = memcmp(pa, pb, la < lb ? la : lb);
+
+    if (c != 0)
+        return c;
+    return la < lb ? -1 : la > lb;
+}
+
+static int flush_filesystems(Task *tasks, size_t count, Filesystem **filesystems, size_t *fscount)
+{
+    Filesystem *grown;
+    size_t k, f;
+    int fd, rv = 0;
+
+    for (k = 0; k < count; k++)
+    {
+        if (tasks[k].copy == NULL)
+            continue;
+
+        /* Flush each filesystem once, through its first copy */
+        for (f = 0; f < *fscount; f++)
+        {
+            if ((*filesystems)[f].dev == tasks[k].dev)
+                break;
+        }
+        if (f < *fscount)
+            continue;
+
+        if ((grown = realloc(*filesystems, sizeof(Filesystem) * (*fscount + 1))) == NULL)
+        {
+            fprintf(stderr, "Failed to allocate memory for the filesystems: %s!\n", strerror(errno));
+            return 3;
+        }
+        *filesystems = grown;
+        (*filesystems)[*fscount].dev = tasks[k].dev;
+        (*filesystems)[*fscount].flushed = 0;
+
+        if ((fd = open(tasks[k].copy, O_RDONLY | O_CLOEXEC)) != -1 && syncfs(fd) == 0)
+            (*filesystems)[*fscount].flushed = 1;
+        else
+        {
+            fprintf(stderr, "Failed to flush the filesystem of %s: %s!\n", tasks[k].copy, strerror(errno));
+            rv = 4;
+        }
+        if (fd != -1)
+            close(fd);
+        (*fscount)++;
+    }
+
+    return rv;
+}
+
+static int flush_directories(const char **copies, size_t count)
+{
+    char directory[PATH_MAX];
+    size_t k;
+    int fd, rv = 0;
+
+    /* Flush each directory once, the copies of a directory are sorted together */
+    qsort(copies, count, sizeof(const char*), compare_directories);
+    for (k = 0; k < count; k++)
+    {
+        if (k > 0 && compare_directories(&copies[k - 1], &copies[k]) == 0)
+            continue;
+
+        sprintf(directory, "%.*s", (int)(strrchr(copies[k], '/') - copies[k]), copies[k]);
+        if ((fd = open(directory[0] != '\0' ? directory : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 || fsync(fd) != 0)
+        {
+            fprintf(stderr, "Failed to flush the directory %s: %s!\n", directory, strerror(errno));
+            rv = 4;
+        }
+        if (fd != -1)
+            close(fd);
+    }
+
+    return rv;
+}
+
+static int flushed(const Filesystem *filesystems, size_t fscount, dev_t dev)
+{
+    size_t f;
+
+    for (f = 0; f < fscount; f++)
+    {
+        if (filesystems[f].dev == dev)
+            return filesystems[f].flushed;
+    }
+
+    return 0;
+}
+
+/* Flush all the copies, then replace their files, then flush the renamings */
+static int replace_files(Task *tasks, size_t count)
+{
+    Filesystem *filesystems = NULL;
+    const char **replaced;
+    size_t k, fscount = 0, replacedCount = 0;
+    int rv, e;
+
+    if ((replaced = malloc(sizeof(const char*) * count)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the copies: %s!\n", strerror(errno));
+        rv = 3;
+    }
+    else
+        rv = flush_filesystems(tasks, count, &filesystems, &fscount);
+
+    for (k = 0; k < count; k++)
+    {
+        if (tasks[k].copy == NULL)
+            continue;
+
+        /* A copy which may not be on the disk never replaces its file */
+        if (replaced == NULL || !flushed(filesystems, fscount, tasks[k].dev) || !dynamics_replace(tasks[k].copy, stderr))
+        {
+            unlink(tasks[k].copy);
+            if (rv < 4)
+                rv = 4;
+            continue;
+        }
+        replaced[replacedCount++] = tasks[k].copy;
+    }
+
+    if (replaced != NULL && (e = flush_directories(replaced, replacedCount)) > rv)
+        rv = e;
+
+    for (k = 0; k < count; k++)
+        free(tasks[k].copy);
+    free(replaced);
+    free(filesystems);
+
+    return rv;
+}
+
+int batch_run(const LD_Cache *ldcache, const char *const *files, size_t count, unsigned int jobs, const Batch_Options *options)
+{
+    Pool pool;
+    pthread_t *threads;
+    size_t k;
+    unsigned int t, started = 0;
+    int rv = 0, e;
+
+    if (count == 0)
+        return 0;
+    if (jobs == 0)
+        jobs = 1;
+    if (jobs > count)
+        jobs = count;
+
+    /* Allocate the tasks */
+    if ((pool.tasks = calloc(count, sizeof(Task))) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the tasks: %s!\n", strerror(errno));
+        return 3;
+    }
+    if ((threads = malloc(sizeof(pthread_t) * jobs)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the workers: %s!\n", strerror(errno));
+        free(pool.tasks);
+        return 3;
+    }
+
+    /* The libraries are shared by the closures of all the files */
+    pool.memo = NULL;
+    if (options->query == QU_CLOSURE && (pool.memo = closure_create(options->index)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the closure: %s!\n", strerror(errno));
+        free(threads);
+        free(pool.tasks);
+        return 3;
+    }
+
+    pool.ldcache = ldcache;
+    pool.files = files;
+    pool.options = options;
+    pool.count = count;
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.ready, NULL);
+
+    /* Start the workers */
+    for (t = 0; t < jobs; t++)
+    {
+        if ((e = pthread_create(&threads[started], NULL, worker, &pool)) != 0)
+        {
+            fprintf(stderr, "Failed to start a worker: %s!\n", strerror(e));
+            continue;
+        }
+        started++;
+    }
+
+    /* If no worker could be started, do the work ourselves */
+    if (started == 0)
+        worker(&pool);
+
+    /* Print the results in the order of the files, as soon as they are available */
+    for (k = 0; k < count; k++)
+    {
+        Task *task = &pool.tasks[k];
+
+        pthread_mutex_lock(&pool.lock);
+        while (!task->done)
+            pthread_cond_wait(&pool.ready, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (task->out != NULL)
+            fwrite(task->out, 1, task->outlen, stdout);
+        if (task->err != NULL)
+            fwrite(task->err, 1, task->errlen, stderr);
+        if (task->plan != NULL)
+            fwrite(task->plan, 1, task->planlen, options->plan);
+        fflush(stdout);
+
+        free(task->out);
+        free(task->err);
+        free(task->plan);
+
+        /* Keep the most severe code */
+        if (task->rv > rv)
+            rv = task->rv;
+    }
+
+    for (t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    /* The files are only replaced once all their copies are on the disk */
+    if (options->mode == WR_ATOMIC && (e = replace_files(pool.tasks, count)) > rv)
+        rv = e;
+
+    if (pool.memo != NULL)
+        closure_free(pool.memo);
+
+    pthread_cond_destroy(&pool.ready);
+    pthread_mutex_destroy(&pool.lock);
+    free(threads);
+    free(pool.tasks);
+
+    return rv;
+}
@@ -0,0 +1,33 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Process many ELF files in a single invocation, using a pool of workers.
+ */
+
+#ifndef BATCH_H_INCLUDED
+#define BATCH_H_INCLUDED
+
+#include "dynamic.h"
+#include "scanindex.h"
+#include "repair.h"
+
+typedef struct
+{
+    const Replacement *replacements;
+    const char *soname;
+    const char *rpath;
+    Priority priority;
+    Query query;
+    Format format;
+    int fix;
+    Write_Mode mode;
+    Scan_Index *index;
+    Repair_Phase repair;
+    Repair_File *repairs; /* One per file: gathered by the plan, or replacing the common replacements */
+    FILE *plan;           /* Receives the patches of the files, which are left as they are */
+} Batch_Options;
+
+int batch_run(const LD_Cache *ldcache, const char *const *files, size_t count, unsigned int jobs, const Batch_Options *options);
+
+#endif
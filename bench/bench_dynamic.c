@@ -0,0 +1,396 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Measure the queries and the modifications over a corpus of synthetic ELF files.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "dynamic.h"
+#include "elffile.h"
+#include "ldcache.h"
+#include "patch.h"
+#include "synth.h"
+
+#define CORPUS_FILES 2000
+#define TRACED_FILES 100
+#define WALK_PASSES 64
+
+typedef struct
+{
+    const char *name;
+    int (*run)(const char *filename);
+    int modifies; /* The corpus has to be generated again before each run */
+    int (*prepare)(void);
+} Scenario;
+
+typedef struct
+{
+    double elapsed;
+    unsigned failures;
+} Result;
+
+static char directory[] = "/tmp/dyngler-bench-XXXXXX";
+static char cachename[sizeof(directory) + 16];
+static LD_Cache *cache;
+static FILE *sink;
+
+static const Replacement replacements[] =
+{
+    { "libsynth0000.so.1", "libswap0000.so.1" },
+    { NULL, NULL }
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Every version 2, and version 1 of half of them: the others are missing, but can be repaired */
+static void synth_name(uint32_t index, char name[SYNTH_NAME_MAX])
+{
+    if (index < 500)
+        sprintf(name, "libsynth%04u.so.2", index);
+    else
+        sprintf(name, SYNTH_NEEDED_FORMAT, (index - 500) * 2);
+}
+
+static void file_name(uint32_t index, char *filename)
+{
+    sprintf(filename, "%s/lib%05u.so", directory, index);
+}
+
+static void plan_name(const char *filename, char *planname)
+{
+    sprintf(planname, "%s.plan", filename);
+}
+
+static int generate_corpus(void)
+{
+    Synth_Elf spec;
+    char filename[sizeof(directory) + 16];
+    uint32_t i;
+
+    for (i = 0; i < CORPUS_FILES; i++)
+    {
+        synth_corpus_spec(i, &spec);
+        file_name(i, filename);
+        if (!synth_write_elf(filename, &spec))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void remove_corpus(void)
+{
+    char filename[sizeof(directory) + 16], planname[sizeof(directory) + 32];
+    uint32_t i;
+
+    for (i = 0; i < CORPUS_FILES; i++)
+    {
+        file_name(i, filename);
+        plan_name(filename, planname);
+        unlink(filename);
+        unlink(planname);
+    }
+    unlink(cachename);
+    rmdir(directory);
+}
+
+/* The class and the byte order tested for each field, as the dynamic array was read before the walkers */
+static void decode_generic(const Elf_File *elf, const char *data, size_t count, Elf_Dynamic *entries)
+{
+    const Elf32_Dyn *dyn32 = (const Elf32_Dyn*)data;
+    const Elf64_Dyn *dyn64 = (const Elf64_Dyn*)data;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        entries[i].tag = elf->e32 ? DO_SWAPS32(elf, dyn32[i].d_tag) : DO_SWAPS64(elf, dyn64[i].d_tag);
+        entries[i].val = elf->e32 ? DO_SWAPU32(elf, dyn32[i].d_un.d_val) : DO_SWAPU64(elf, dyn64[i].d_un.d_val);
+    }
+}
+
+/* Decode the dynamic array of the file many times, so that the walk outweighs opening the file */
+static int walk_file(const char *filename, int generic)
+{
+    Elf_File elf;
+    Elf_Program phdr;
+    Elf_Dynamic *entries;
+    const char *dyns;
+    size_t length, count, k;
+    int rv = 1;
+
+    if (elf_open(&elf, filename, O_RDONLY, sink) == -1)
+        return 1;
+
+    if (elf_find_program(&elf, PT_DYNAMIC, &phdr) == 0 &&
+        (dyns = elf_data(&elf, HDRWU(&elf, phdr, p_offset), length = HDRWU(&elf, phdr, p_filesz))) != NULL)
+    {
+        if ((entries = elf_dynamic(&elf, dyns, length, &count)) != NULL)
+        {
+            for (k = 1; k < WALK_PASSES; k++)
+            {
+                if (generic)
+                    decode_generic(&elf, dyns, count, entries);
+                else
+                    elf.walker->decode(dyns, count, entries);
+            }
+            rv = 0;
+            free(entries);
+        }
+        elf_data_free(&elf, (char*)dyns);
+    }
+
+    elf_close(&elf);
+    return rv;
+}
+
+static int run_walk(const char *filename)
+{
+    return walk_file(filename, 0);
+}
+
+static int run_walkref(const char *filename)
+{
+    return walk_file(filename, 1);
+}
+
+static int run_needed(const char *filename)
+{
+    return dynamics_query(NULL, NULL, filename, QU_NEEDED, FMT_TEXT, sink, sink);
+}
+
+static int run_missing(const char *filename)
+{
+    const int rv = dynamics_query(cache, NULL, filename, QU_MISSING, FMT_TEXT, sink, sink);
+    ldcache_clearpath(cache);
+    return rv;
+}
+
+static int run_replace(const char *filename)
+{
+    return dynamics_process(NULL, PRI_UNCHANGED, filename, NULL, replacements, NULL, NULL, 0, WR_INPLACE, NULL, NULL, sink, sink);
+}
+
+static int run_soname(const char *filename)
+{
+    return dynamics_process(NULL, PRI_UNCHANGED, filename, NULL, replacements + 1, "librenamed.so.1", NULL, 0, WR_INPLACE, NULL, NULL, sink, sink);
+}
+
+static int run_rpath(const char *filename)
+{
+    return dynamics_process(NULL, PRI_UNCHANGED, filename, NULL, replacements + 1, NULL, "$ORIGIN/lyb", 0, WR_INPLACE, NULL, NULL, sink, sink);
+}
+
+static int run_repair(const char *filename)
+{
+    const int rv = dynamics_process(cache, PRI_UNCHANGED, filename, NULL, replacements + 1, NULL, NULL, 2, WR_INPLACE, NULL, NULL, sink, sink);
+    ldcache_clearpath(cache);
+    return rv;
+}
+
+static int run_apply(const char *filename)
+{
+    char planname[sizeof(directory) + 32];
+
+    plan_name(filename, planname);
+    return patch_apply(planname, 0, sink, sink);
+}
+
+/* Plan the repair of each file, the scenario only applies the patches */
+static int plan_repair(void)
+{
+    char filename[sizeof(directory) + 16], planname[sizeof(directory) + 32];
+    FILE *plan;
+    uint32_t i;
+
+    for (i = 0; i < CORPUS_FILES; i++)
+    {
+        file_name(i, filename);
+        plan_name(filename, planname);
+        if ((plan = patch_create(planname, sink)) == NULL)
+            return 0;
+        dynamics_process(cache, PRI_UNCHANGED, filename, NULL, replacements + 1, NULL, NULL, 2, WR_INPLACE, NULL, plan, sink, sink);
+        ldcache_clearpath(cache);
+        if (fclose(plan) != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static unsigned run_files(const Scenario *scenario, uint32_t count)
+{
+    char filename[sizeof(directory) + 16];
+    unsigned failures = 0;
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        file_name(i, filename);
+        if (scenario->run(filename) != 0)
+            failures++;
+    }
+    fflush(sink);
+
+    return failures;
+}
+
+/* Run the whole corpus in a child, so that its peak memory is its own */
+static int time_scenario(const Scenario *scenario, Result *result, long *maxrss)
+{
+    struct rusage usage;
+    int fds[2], status;
+    pid_t pid;
+
+    if (pipe(fds) != 0 || (pid = fork()) == -1)
+    {
+        perror("Failed to start the benchmark");
+        return 0;
+    }
+
+    if (pid == 0)
+    {
+        const double start = now();
+
+        close(fds[0]);
+        result->failures = run_files(scenario, CORPUS_FILES);
+        result->elapsed = now() - start;
+        _exit(write(fds[1], result, sizeof(Result)) == sizeof(Result) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    status = read(fds[0], result, sizeof(Result)) == sizeof(Result);
+    close(fds[0]);
+
+    if (wait4(pid, NULL, 0, &usage) == -1)
+        return 0;
+    *maxrss = usage.ru_maxrss;
+
+    return status;
+}
+
+/* Count the system calls of a child traced over the first files, or -1 if it can't be traced */
+static double count_syscalls(const Scenario *scenario)
+{
+    unsigned long stops = 0;
+    int status, signum = 0;
+    pid_t pid;
+
+    if ((pid = fork()) == -1)
+        return -1;
+
+    if (pid == 0)
+    {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+            _exit(2);
+        raise(SIGSTOP);
+        run_files(scenario, TRACED_FILES);
+        _exit(0);
+    }
+
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status) ||
+        ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL)) != 0)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+
+    /* Each system call stops the child twice, on entry then on exit */
+    for (;;)
+    {
+        if (ptrace(PTRACE_SYSCALL, pid, NULL, (void*)(long)signum) != 0 || waitpid(pid, &status, 0) == -1)
+            break;
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+            break;
+
+        signum = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+            stops++;
+        else
+            signum = WSTOPSIG(status);
+    }
+
+    return stops / 2.0 / TRACED_FILES;
+}
+
+static void measure(const Scenario *scenario)
+{
+    Result result;
+    long maxrss = 0;
+    double syscalls;
+
+    if (!generate_corpus() || (scenario->prepare != NULL && !scenario->prepare()) || !time_scenario(scenario, &result, &maxrss))
+        return;
+    if (scenario->modifies && (!generate_corpus() || (scenario->prepare != NULL && !scenario->prepare())))
+        return;
+    syscalls = count_syscalls(scenario);
+
+    printf("%-8s: %9.0f files/s", scenario->name, CORPUS_FILES / result.elapsed);
+    if (syscalls >= 0)
+        printf(", %6.1f syscalls/file", syscalls);
+    else
+        printf(",     n/a syscalls/file");
+    printf(", %6ld KiB peak RSS", maxrss);
+    if (result.failures > 0)
+        printf(" (%u failures)", result.failures);
+    putchar('\n');
+    fflush(stdout);
+}
+
+int main(void)
+{
+    static const Scenario scenarios[] =
+    {
+        { "walk",    run_walk,    0, NULL },
+        { "walkref", run_walkref, 0, NULL },
+        { "needed",  run_needed,  0, NULL },
+        { "missing", run_missing, 0, NULL },
+        { "replace", run_replace, 1, NULL },
+        { "soname",  run_soname,  1, NULL },
+        { "rpath",   run_rpath,   1, NULL },
+        { "repair",  run_repair,  1, NULL },
+        { "apply",   run_apply,   1, plan_repair }
+    };
+    size_t i;
+
+    if (mkdtemp(directory) == NULL)
+    {
+        perror("Failed to create the synthetic corpus");
+        return 1;
+    }
+
+    sprintf(cachename, "%s/ld.so.cache", directory);
+    if ((sink = fopen("/dev/null", "w")) == NULL ||
+        !synth_write_cache(cachename, 750, synth_name) || (cache = ldcache_parse(cachename)) == NULL)
+    {
+        perror("Failed to prepare the benchmark");
+        remove_corpus();
+        return 1;
+    }
+
+    printf("%d synthetic files (ELF32/ELF64, LSB/MSB, 1-500 needed, with and without sections)\n", CORPUS_FILES);
+    for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+        measure(&scenarios[i]);
+
+    ldcache_free(cache);
+    fclose(sink);
+    remove_corpus();
+
+    return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Measure the ld.so.cache parsing, lookups and footprint against synthetic caches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ldcache.h"
+#include "synth.h"
+
+#define LOOKUPS 1000000
+#define SETPATHS 100000
+#define NAMES 1024 /* A power of two */
+
+/* The parses are repeated for at least this long, and this many times */
+#define PARSE_SECONDS 0.2
+#define PARSES 5
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void synth_name(uint32_t index, char name[SYNTH_NAME_MAX])
+{
+    sprintf(name, "libsynth%u.so.%u", index, index % 7);
+}
+
+/* Heap allocated by the process, when the C library tells it */
+static size_t heap_used(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+/* Average time of a parse, repeated long enough to be measured */
+static double bench_parse(const char *filename)
+{
+    LD_Cache *cache;
+    double start, elapsed;
+    unsigned parses = 0;
+
+    start = now();
+    do
+    {
+        if ((cache = ldcache_parse(filename)) == NULL)
+            return 0;
+        ldcache_free(cache);
+        parses++;
+        elapsed = now() - start;
+    }
+    while (elapsed < PARSE_SECONDS || parses < PARSES);
+
+    return elapsed / parses;
+}
+
+/* Average time of a lookup over the prepared names */
+static double bench_lookups(const LD_Cache *cache, char (*names)[64], int replacement, unsigned *found)
+{
+    double start;
+    uint32_t i;
+
+    *found = 0;
+    start = now();
+    if (replacement)
+    {
+        for (i = 0; i < LOOKUPS; i++)
+            *found += ldcache_replacement(cache, names[i & (NAMES - 1)], LD_ANY_LENGTH) != NULL;
+    }
+    else
+    {
+        for (i = 0; i < LOOKUPS; i++)
+            *found += ldcache_search(cache, names[i & (NAMES - 1)]);
+    }
+
+    return (now() - start) / LOOKUPS;
+}
+
+/* Average time to set then clear a run-time path with an origin */
+static double bench_setpath(LD_Cache *cache)
+{
+    double start;
+    uint32_t i;
+
+    start = now();
+    for (i = 0; i < SETPATHS; i++)
+    {
+        ldcache_setpath(cache, "$ORIGIN:$ORIGIN/../lib:/opt/synth/lib:/usr/local/lib", "/opt/synth/bin/program");
+        ldcache_clearpath(cache);
+    }
+
+    return (now() - start) / SETPATHS;
+}
+
+static void bench(uint32_t count)
+{
+    char filename[] = "/tmp/dyngler-bench-XXXXXX";
+    char (*names)[64];
+    LD_Cache *cache;
+    double parse, hit, miss, replacement, setpath;
+    size_t heap;
+    unsigned hits, misses, replaced;
+    uint32_t i;
+    int fd;
+
+    if ((fd = mkstemp(filename)) == -1)
+    {
+        perror("Failed to create the synthetic cache");
+        return;
+    }
+    close(fd);
+
+    if (!synth_write_cache(filename, count, synth_name) || (parse = bench_parse(filename)) == 0)
+    {
+        unlink(filename);
+        return;
+    }
+
+    /* The footprint of a parsed cache: its own allocations, then the mapped file */
+    heap = heap_used();
+    if ((cache = ldcache_parse(filename)) == NULL)
+    {
+        unlink(filename);
+        return;
+    }
+    heap = heap_used() - heap;
+
+    /* Prepare the names beforehand */
+    if ((names = malloc(sizeof(*names) * NAMES)) == NULL)
+    {
+        perror("Failed to allocate the names");
+        ldcache_free(cache);
+        unlink(filename);
+        return;
+    }
+
+    for (i = 0; i < NAMES; i++)
+    {
+        const uint32_t n = (i * 2654435761u) % count;
+        sprintf(names[i], "libsynth%u.so.%u", n, n % 7);
+    }
+    hit = bench_lookups(cache, names, 0, &hits);
+
+    for (i = 0; i < NAMES; i++)
+    {
+        const uint32_t n = (i * 2654435761u) % count;
+        sprintf(names[i], "libmissing%u.so.%u", n, n % 7);
+    }
+    miss = bench_lookups(cache, names, 0, &misses);
+
+    /* Another version of a library in the cache, as the repairs look for */
+    for (i = 0; i < NAMES; i++)
+    {
+        const uint32_t n = (i * 2654435761u) % count;
+        sprintf(names[i], "libsynth%u.so.%u", n, n % 7 + 1);
+    }
+    replacement = bench_lookups(cache, names, 1, &replaced);
+
+    setpath = bench_setpath(cache);
+
+    printf("%7u entries: parse %8.1f us, %6lu KiB heap + %6lu KiB mapped\n", count, parse * 1e6,
+           (unsigned long)(heap / 1024), (unsigned long)(cache->size / 1024));
+    printf("                search %6.1f ns (hit, %u found), %6.1f ns (miss, %u found)\n",
+           hit * 1e9, hits, miss * 1e9, misses);
+    printf("                replacement %6.1f ns (%u found), setpath %6.1f ns\n",
+           replacement * 1e9, replaced, setpath * 1e9);
+
+    free(names);
+    ldcache_free(cache);
+    unlink(filename);
+}
+
+int main(void)
+{
+#if !defined(__GLIBC__) || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 33)
+    puts("The heap footprint needs mallinfo2, it is reported as 0.");
+#endif
+    bench(1000);
+    bench(10000);
+    bench(100000);
+    return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Generate the synthetic ELF files and ld.so.cache files the benchmarks run on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+#include "synth.h"
+
+#define CACHE_MAGIC "glibc-ld.so.cache1.1"
+
+/* Room left at the end of the .dynstr, so that the strings can grow */
+#define SYNTH_SLACK 64
+
+#define SHSTRTAB "\0.dynstr\0.dynamic\0.shstrtab"
+
+/* Write a value of the given size in the byte order of the file */
+static unsigned char* put(unsigned char *p, uint64_t value, int size, int big)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+        p[big ? size - 1 - i : i] = (unsigned char)(value >> (8 * i));
+
+    return p + size;
+}
+
+static size_t align8(size_t offset)
+{
+    return (offset + 7) & ~(size_t)7;
+}
+
+static unsigned char* put_program(unsigned char *p, const Synth_Elf *spec, uint32_t type, uint32_t flags, uint64_t offset, uint64_t size, uint64_t align)
+{
+    const int w = spec->e32 ? 4 : 8, b = spec->big;
+
+    p = put(p, type, 4, b);
+    if (!spec->e32)
+        p = put(p, flags, 4, b);
+    p = put(p, offset, w, b);
+    p = put(p, SYNTH_BASE + offset, w, b);
+    p = put(p, SYNTH_BASE + offset, w, b);
+    p = put(p, size, w, b);
+    p = put(p, size, w, b);
+    if (spec->e32)
+        p = put(p, flags, 4, b);
+    return put(p, align, w, b);
+}
+
+static unsigned char* put_section(unsigned char *p, const Synth_Elf *spec, uint32_t name, uint32_t type, uint64_t flags, uint64_t offset, uint64_t size, uint32_t link, uint64_t entsize)
+{
+    const int w = spec->e32 ? 4 : 8, b = spec->big;
+
+    p = put(p, name, 4, b);
+    p = put(p, type, 4, b);
+    p = put(p, flags, w, b);
+    p = put(p, flags & SHF_ALLOC ? SYNTH_BASE + offset : 0, w, b);
+    p = put(p, offset, w, b);
+    p = put(p, size, w, b);
+    p = put(p, link, 4, b);
+    p = put(p, 0, 4, b);
+    p = put(p, 1, w, b);
+    return put(p, entsize, w, b);
+}
+
+int synth_write_elf(const char *filename, const Synth_Elf *spec)
+{
+    FILE *file;
+    unsigned char *data, *p;
+    char name[SYNTH_NAME_MAX];
+    const int w = spec->e32 ? 4 : 8, b = spec->big;
+    const size_t ehsize = spec->e32 ? sizeof(Elf32_Ehdr) : sizeof(Elf64_Ehdr);
+    const size_t phentsize = spec->e32 ? sizeof(Elf32_Phdr) : sizeof(Elf64_Phdr);
+    const size_t shentsize = spec->e32 ? sizeof(Elf32_Shdr) : sizeof(Elf64_Shdr);
+    const size_t dynentsize = 2 * w;
+    const size_t dyncount = spec->needed + 5;
+    size_t stroff, strsz, dynoff, shstroff, shoff, size, pos, sonamepos, runpathpos;
+    unsigned k;
+    int rv;
+
+    /* Size the string table: the needed names, the soname, the run-time path, then the filler */
+    strsz = 1 + spec->needed * (sizeof("libsynth0000.so.1")) + sizeof(SYNTH_SONAME) + sizeof(SYNTH_RUNPATH) + spec->filler + SYNTH_SLACK;
+
+    /* Headers, string table, dynamic array, then the section names and headers */
+    stroff = ehsize + 2 * phentsize;
+    dynoff = align8(stroff + strsz);
+    shstroff = dynoff + dyncount * dynentsize;
+    shoff = align8(shstroff + sizeof(SHSTRTAB));
+    size = spec->sections ? shoff + 4 * shentsize : shstroff;
+
+    if ((data = calloc(1, size)) == NULL)
+    {
+        perror("Failed to allocate the synthetic file");
+        return 0;
+    }
+
+    /* ELF header */
+    memcpy(data, ELFMAG, SELFMAG);
+    data[EI_CLASS] = spec->e32 ? ELFCLASS32 : ELFCLASS64;
+    data[EI_DATA] = b ? ELFDATA2MSB : ELFDATA2LSB;
+    data[EI_VERSION] = EV_CURRENT;
+    p = data + EI_NIDENT;
+    p = put(p, ET_DYN, 2, b);
+    p = put(p, spec->e32 ? (b ? EM_PPC : EM_386) : (b ? EM_PPC64 : EM_X86_64), 2, b);
+    p = put(p, EV_CURRENT, 4, b);
+    p = put(p, 0, w, b);
+    p = put(p, ehsize, w, b);
+    p = put(p, spec->sections ? shoff : 0, w, b);
+    p = put(p, 0, 4, b);
+    p = put(p, ehsize, 2, b);
+    p = put(p, phentsize, 2, b);
+    p = put(p, 2, 2, b);
+    p = put(p, shentsize, 2, b);
+    p = put(p, spec->sections ? 4 : 0, 2, b);
+    put(p, spec->sections ? 3 : 0, 2, b);
+
+    /* A single segment maps the whole file */
+    p = data + ehsize;
+    p = put_program(p, spec, PT_LOAD, PF_R | PF_W, 0, size, 0x1000);
+    put_program(p, spec, PT_DYNAMIC, PF_R | PF_W, dynoff, dyncount * dynentsize, 8);
+
+    /* Dynamic strings */
+    p = data + dynoff;
+    pos = 1;
+    for (k = 0; k < spec->needed; k++)
+    {
+        sprintf(name, SYNTH_NEEDED_FORMAT, k);
+        strcpy((char*)data + stroff + pos, name);
+        p = put(p, DT_NEEDED, w, b);
+        p = put(p, pos, w, b);
+        pos += strlen(name) + 1;
+    }
+    sonamepos = pos;
+    strcpy((char*)data + stroff + pos, SYNTH_SONAME);
+    pos += sizeof(SYNTH_SONAME);
+    runpathpos = pos;
+    strcpy((char*)data + stroff + pos, SYNTH_RUNPATH);
+    pos += sizeof(SYNTH_RUNPATH);
+
+    /* Strings nobody refers to, the way the symbol names fill a real table */
+    for (k = 0; pos + SYNTH_NAME_MAX < strsz - SYNTH_SLACK; k++)
+        pos += sprintf((char*)data + stroff + pos, "synth_symbol_%u", k) + 1;
+
+    p = put(p, DT_SONAME, w, b);
+    p = put(p, sonamepos, w, b);
+    p = put(p, DT_RUNPATH, w, b);
+    p = put(p, runpathpos, w, b);
+    p = put(p, DT_STRTAB, w, b);
+    p = put(p, SYNTH_BASE + stroff, w, b);
+    p = put(p, DT_STRSZ, w, b);
+    put(p, strsz, w, b);
+
+    /* Optional section headers, which the tool only uses as a fallback */
+    if (spec->sections)
+    {
+        memcpy(data + shstroff, SHSTRTAB, sizeof(SHSTRTAB));
+        p = data + shoff + shentsize;
+        p = put_section(p, spec, 1, SHT_STRTAB, SHF_ALLOC, stroff, strsz, 0, 0);
+        p = put_section(p, spec, 9, SHT_DYNAMIC, SHF_ALLOC | SHF_WRITE, dynoff, dyncount * dynentsize, 1, dynentsize);
+        put_section(p, spec, 18, SHT_STRTAB, 0, shstroff, sizeof(SHSTRTAB), 0, 0);
+    }
+
+    if ((file = fopen(filename, "wb")) == NULL)
+    {
+        perror("Failed to create the synthetic file");
+        free(data);
+        return 0;
+    }
+    rv = fwrite(data, 1, size, file) == size;
+    rv = fclose(file) == 0 && rv;
+    free(data);
+
+    return rv;
+}
+
+void synth_corpus_spec(uint32_t index, Synth_Elf *spec)
+{
+    const uint32_t h = index * 2654435761u;
+
+    /* Every combination of class, byte order and section headers, in turn */
+    spec->e32 = index & 1;
+    spec->big = (index >> 1) & 1;
+    spec->sections = (index >> 2) & 1;
+
+    /* Mostly a few dependencies, sometimes hundreds, up to 500 */
+    spec->needed = (h >> 8) % 8 == 0 ? 1 + (h >> 12) % 500 : 1 + (h >> 12) % 16;
+
+    /* Now and then a large .dynstr, as in the libraries exporting many symbols */
+    spec->filler = (h >> 20) % 16 == 0 ? 256 * 1024 : (h >> 20) % 4096;
+}
+
+int synth_write_cache(const char *filename, uint32_t count, Synth_Name name)
+{
+    FILE *file;
+    char libname[SYNTH_NAME_MAX], path[SYNTH_NAME_MAX + 16];
+    uint32_t i, strings, header[7] = { 0 }, entry[6] = { 0 };
+
+    if ((file = fopen(filename, "wb")) == NULL)
+    {
+        perror("Failed to create the synthetic cache");
+        return 0;
+    }
+
+    /* Header, followed by the entries, followed by the strings */
+    header[0] = count;
+    fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC) - 1, file);
+    fwrite(header, sizeof(uint32_t), 7, file);
+
+    strings = sizeof(CACHE_MAGIC) - 1 + sizeof(header) + sizeof(entry) * count;
+    for (i = 0; i < count; i++)
+    {
+        name(i, libname);
+        sprintf(path, "/usr/lib/%s", libname);
+
+        entry[0] = 0x0303;
+        entry[1] = strings;
+        entry[2] = strings + strlen(libname) + 1;
+        fwrite(entry, sizeof(uint32_t), 6, file);
+        strings += strlen(libname) + strlen(path) + 2;
+    }
+    for (i = 0; i < count; i++)
+    {
+        name(i, libname);
+        sprintf(path, "/usr/lib/%s", libname);
+        fwrite(libname, 1, strlen(libname) + 1, file);
+        fwrite(path, 1, strlen(path) + 1, file);
+    }
+
+    return fclose(file) == 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Generate the synthetic ELF files and ld.so.cache files the benchmarks run on.
+ */
+
+#ifndef SYNTH_H_INCLUDED
+#define SYNTH_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SYNTH_NAME_MAX 64
+
+/* Base address of the single loaded segment, which maps the whole file */
+#define SYNTH_BASE 0x400000
+
+typedef struct
+{
+    int e32;         /* ELFCLASS32 instead of ELFCLASS64 */
+    int big;         /* ELFDATA2MSB instead of ELFDATA2LSB */
+    int sections;    /* Write the section headers, otherwise only the program headers */
+    unsigned needed; /* Number of DT_NEEDED entries */
+    size_t filler;   /* Bytes of symbol-like strings added to the .dynstr */
+} Synth_Elf;
+
+/* Names the libraries of a synthetic cache */
+typedef void (*Synth_Name)(uint32_t index, char name[SYNTH_NAME_MAX]);
+
+/* The needed libraries are named SYNTH_NEEDED_FORMAT, from 0 to needed - 1 */
+#define SYNTH_NEEDED_FORMAT "libsynth%04u.so.1"
+#define SYNTH_SONAME "libsynthetic.so.1"
+#define SYNTH_RUNPATH "$ORIGIN/lib"
+
+int synth_write_elf(const char *filename, const Synth_Elf *spec);
+void synth_corpus_spec(uint32_t index, Synth_Elf *spec);
+int synth_write_cache(const char *filename, uint32_t count, Synth_Name name);
+
+#endif
@@ -0,0 +1,502 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Resolve the dependencies of ELF files recursively, the way the loader does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "closure.h"
+#include "json.h"
+#include "stats.h"
+#include "probes.h"
+
+#define NO_LOADER ((size_t)-1)
+
+/* Value of the names which couldn't be found */
+#define MISSING ((size_t)-1)
+
+/* A file in the closure, in the order the loader maps them */
+typedef struct
+{
+    const Closure_Library *library;
+    char *path;
+    LD_Path *rpath;
+    LD_Path *runpath;
+    size_t rpathlen;
+    size_t runpathlen;
+    size_t loader;
+} Visit;
+
+/* Open-addressing table, of strings or of pointers */
+typedef struct
+{
+    const void **keys;
+    size_t *values;
+    size_t mask;
+    size_t used;
+    int strings;
+} Table;
+
+typedef struct
+{
+    const LD_Cache *ldcache;
+    Closure_Memo *memo;
+    FILE *err;
+    Visit *visits;
+    size_t count;
+    size_t capacity;
+    Table names;
+    Table libraries;
+} Closure;
+
+/* The default directories, searched last */
+static const char *const systemDirs[] =
+{
+#if defined(SYSTEM_LIBS_1)
+    SYSTEM_LIBS_1,
+#endif
+#if defined(SYSTEM_LIBS_2)
+    SYSTEM_LIBS_2,
+#endif
+#if defined(SYSTEM_LIBS_3)
+    SYSTEM_LIBS_3,
+#endif
+    NULL
+};
+
+static uint32_t key_hash(const Table *table, const void *key)
+{
+    const unsigned char *str = key;
+    uint32_t h = 2166136261u;
+
+    /* FNV-1a for the strings, a multiplicative hash for the pointers */
+    if (!table->strings)
+        return (uint32_t)((uintptr_t)key >> 4) * 2654435761u;
+
+    while (*str)
+    {
+        h ^= *str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t table_slot(const Table *table, const void *key)
+{
+    size_t slot = key_hash(table, key) & table->mask;
+
+    /* Probe until the key or an empty slot */
+    while (table->values[slot] != 0)
+    {
+        if (table->strings ? strcmp(table->keys[slot], key) == 0 : table->keys[slot] == key)
+            break;
+        slot = (slot + 1) & table->mask;
+    }
+
+    return slot;
+}
+
+static size_t table_find(const Table *table, const void *key)
+{
+    if (table->values == NULL)
+        return 0;
+
+    return table->values[table_slot(table, key)];
+}
+
+static int table_add(Table *table, const void *key, size_t value, FILE *err)
+{
+    Table grown;
+    size_t i, slot;
+
+    /* Keep the load factor under one half */
+    if ((table->used + 1) * 2 > table->mask + 1 || table->values == NULL)
+    {
+        grown = *table;
+        grown.mask = table->values == NULL ? 63 : table->mask * 2 + 1;
+        grown.used = table->used;
+        grown.keys = malloc(sizeof(void*) * (grown.mask + 1));
+        grown.values = calloc(grown.mask + 1, sizeof(size_t));
+        if (grown.keys == NULL || grown.values == NULL)
+        {
+            fprintf(err, "Failed to allocate memory for the closure: %s!\n", strerror(errno));
+            free(grown.keys);
+            free(grown.values);
+            return 0;
+        }
+
+        for (i = 0; table->values != NULL && i <= table->mask; i++)
+        {
+            if (table->values[i] == 0)
+                continue;
+            slot = table_slot(&grown, table->keys[i]);
+            grown.keys[slot] = table->keys[i];
+            grown.values[slot] = table->values[i];
+        }
+
+        free(table->keys);
+        free(table->values);
+        *table = grown;
+    }
+
+    /* The first value given to a key is kept */
+    slot = table_slot(table, key);
+    if (table->values[slot] == 0)
+    {
+        table->keys[slot] = key;
+        table->values[slot] = value;
+        table->used++;
+    }
+
+    return 1;
+}
+
+static Closure_Library* memo_find(Closure_Library *library, const struct stat *stats)
+{
+    while (library != NULL && (library->dev != stats->st_dev || library->ino != stats->st_ino))
+        library = library->next;
+
+    return library;
+}
+
+static const Closure_Library* memo_get(Closure_Memo *memo, const char *path, FILE *err)
+{
+    Closure_Library *library, *parsed;
+    struct stat stats;
+    size_t slot;
+
+    STATS_COUNT(SC_STAT, 1);
+    if (stat(path, &stats) != 0)
+        return NULL;
+
+    slot = ((size_t)stats.st_dev * 31 + (size_t)stats.st_ino) % CLOSURE_BUCKETS;
+
+    pthread_mutex_lock(&memo->lock);
+    library = memo_find(memo->buckets[slot], &stats);
+    pthread_mutex_unlock(&memo->lock);
+
+    if (library != NULL)
+        return library;
+
+    /* Parse the file without holding the lock, so that the other workers go on */
+    if ((parsed = malloc(sizeof(Closure_Library))) == NULL)
+    {
+        fprintf(err, "Failed to allocate memory for the closure: %s!\n", strerror(errno));
+        return NULL;
+    }
+    parsed->dev = stats.st_dev;
+    parsed->ino = stats.st_ino;
+    parsed->dynamics = scanindex_read(memo->index, path, err);
+
+    /* Another worker may have parsed it meanwhile */
+    pthread_mutex_lock(&memo->lock);
+    if ((library = memo_find(memo->buckets[slot], &stats)) == NULL)
+    {
+        parsed->next = memo->buckets[slot];
+        memo->buckets[slot] = library = parsed;
+        parsed = NULL;
+    }
+    pthread_mutex_unlock(&memo->lock);
+
+    if (parsed != NULL)
+    {
+        free(parsed->dynamics);
+        free(parsed);
+    }
+
+    return library;
+}
+
+static const Closure_Library* try_file(Closure *closure, const char *dir, const char *name, char *path)
+{
+    const Dynamics *root = closure->visits[0].library->dynamics;
+    const Closure_Library *library;
+
+    if (dir != NULL)
+    {
+        /* An empty directory is the working directory */
+        if (dir[0] == '\0')
+            dir = ".";
+        if (!dircache_contains(closure->ldcache != NULL ? closure->ldcache->dirs : NULL, dir, name))
+            return NULL;
+        if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX)
+            return NULL;
+    }
+    else if (snprintf(path, PATH_MAX, "%s", name) >= PATH_MAX)
+        return NULL;
+
+    /* Like the loader, skip the files of another class or architecture */
+    if ((library = memo_get(closure->memo, path, closure->err)) == NULL || library->dynamics == NULL)
+        return NULL;
+    if (library->dynamics->e32 != root->e32 || library->dynamics->machine != root->machine)
+        return NULL;
+
+    return library;
+}
+
+static const Closure_Library* locate(Closure *closure, size_t v, const char *name, char *path, LD_Source *source)
+{
+    const Closure_Library *library;
+    const LD_Entry *entry;
+    size_t l, i;
+
+    /* A name with a slash is a path, relative to the working directory */
+    *source = LD_PATH;
+    if (strchr(name, '/') != NULL)
+        return try_file(closure, NULL, name, path);
+
+    /* Firstly, the "rpath" of the file then the ones of the files which loaded it, unless it has a "runpath" */
+    if (closure->visits[v].library->dynamics->runpath == NULL)
+    {
+        for (l = v; l != NO_LOADER; l = closure->visits[l].loader)
+        {
+            for (i = 0; i < closure->visits[l].rpathlen; i++)
+            {
+                if ((library = try_file(closure, closure->visits[l].rpath[i].path, name, path)) != NULL)
+                    return library;
+            }
+        }
+    }
+
+    /* Then, the "runpath" of the file only */
+    for (i = 0; i < closure->visits[v].runpathlen; i++)
+    {
+        if ((library = try_file(closure, closure->visits[v].runpath[i].path, name, path)) != NULL)
+            return library;
+    }
+
+    /* Then, the cache */
+    *source = LD_CACHE;
+    if (closure->ldcache != NULL && (entry = ldcache_find(closure->ldcache, name)) != NULL)
+    {
+        if ((library = try_file(closure, NULL, entry->path, path)) != NULL)
+            return library;
+    }
+
+    /* Finally, the system directories */
+    *source = LD_SYSTEM;
+    for (i = 0; systemDirs[i] != NULL; i++)
+    {
+        if ((library = try_file(closure, systemDirs[i], name, path)) != NULL)
+            return library;
+    }
+
+    *source = LD_NOWHERE;
+    return NULL;
+}
+
+static int add_visit(Closure *closure, const Closure_Library *library, const char *path, size_t loader)
+{
+    const Dynamics *dynamics = library->dynamics;
+    Visit *visit;
+    void *grown;
+
+    if (closure->count == closure->capacity)
+    {
+        const size_t newCapacity = closure->capacity == 0 ? 64 : closure->capacity * 2;
+        if ((grown = realloc(closure->visits, sizeof(Visit) * newCapacity)) == NULL)
+        {
+            fprintf(closure->err, "Failed to allocate memory for the closure: %s!\n", strerror(errno));
+            return 0;
+        }
+        closure->visits = grown;
+        closure->capacity = newCapacity;
+    }
+
+    visit = &closure->visits[closure->count];
+    memset(visit, 0, sizeof(Visit));
+    visit->library = library;
+    visit->loader = loader;
+
+    if ((visit->path = malloc(strlen(path) + 1)) == NULL)
+    {
+        fprintf(closure->err, "Failed to allocate memory for the closure: %s!\n", strerror(errno));
+        return 0;
+    }
+    strcpy(visit->path, path);
+    closure->count++;
+
+    /* The $ORIGIN of the paths is the location the file was found at.
+     * Like the loader, ignore the "rpath" when there is also a "runpath".
+     */
+    if (dynamics->rpath != NULL && dynamics->runpath == NULL && (visit->rpath = ldcache_splitpath(dynamics->rpath, visit->path, &visit->rpathlen)) == NULL)
+        return 0;
+    if (dynamics->runpath != NULL && (visit->runpath = ldcache_splitpath(dynamics->runpath, visit->path, &visit->runpathlen)) == NULL)
+        return 0;
+
+    /* A file satisfies the dependencies on its soname */
+    if (!table_add(&closure->libraries, library, closure->count, closure->err))
+        return 0;
+    if (dynamics->soname != NULL && !table_add(&closure->names, dynamics->soname, closure->count, closure->err))
+        return 0;
+
+    return 1;
+}
+
+Closure_Memo* closure_create(Scan_Index *index)
+{
+    Closure_Memo *memo;
+
+    if ((memo = calloc(1, sizeof(Closure_Memo))) == NULL)
+        return NULL;
+    memo->index = index;
+    pthread_mutex_init(&memo->lock, NULL);
+
+    return memo;
+}
+
+int closure_query(const LD_Cache *ldcache, Closure_Memo *memo, const char *filename, const Format format, FILE *out, FILE *err)
+{
+    Closure closure;
+    Json_Buffer json = { NULL, 0, 0, 0 }, missing = { NULL, 0, 0, 0 };
+    const Closure_Library *library;
+    char path[PATH_MAX];
+    size_t v, k, found;
+    uint64_t started = 0;
+    LD_Source source;
+    int rv = 0;
+
+    memset(&closure, 0, sizeof(Closure));
+    closure.ldcache = ldcache;
+    closure.memo = memo;
+    closure.err = err;
+    closure.names.strings = 1;
+
+    /* The file itself is the root of the closure */
+    if ((library = memo_get(memo, filename, err)) == NULL)
+    {
+        fprintf(err, "Failed to open file: %s!\n", strerror(errno));
+        return 3;
+    }
+    if (library->dynamics == NULL)
+        return 3;
+    if (!add_visit(&closure, library, filename, NO_LOADER))
+    {
+        rv = 3;
+        goto RET;
+    }
+
+    if (format == FMT_NDJSON)
+    {
+        json_raw(&json, "{");
+        json_key(&json, "file");
+        json_string(&json, filename);
+        json_key(&json, "closure");
+        json_raw(&json, "[");
+    }
+
+    /* Breadth first, since the loader maps the dependencies of a file before their own */
+    for (v = 0; v < closure.count; v++)
+    {
+        const Dynamics *dynamics = closure.visits[v].library->dynamics;
+
+        for (k = 0; k < dynamics->neededlen; k++)
+        {
+            const char *name = dynamics->needed[k];
+
+            /* A file already loaded by this name satisfies the dependency */
+            if (table_find(&closure.names, name) != 0)
+                continue;
+
+            /* The files parsed along the way count in their own phases */
+            STATS_START(started);
+            library = locate(&closure, v, name, path, &source);
+            STATS_LAP(ST_RESOLVE, started);
+            PROBE2(dyngler, resolve, name, source);
+
+            if (library == NULL)
+            {
+                if (format == FMT_NDJSON)
+                {
+                    if (missing.length > 0)
+                        json_raw(&missing, ",");
+                    json_string(&missing, name);
+                }
+                else
+                    fprintf(out, "%s => not found\n", name);
+                found = MISSING;
+            }
+            /* The same file may be found by another name */
+            else if ((found = table_find(&closure.libraries, library)) == 0)
+            {
+                if (format == FMT_NDJSON)
+                {
+                    json_raw(&json, closure.count > 1 ? ",{" : "{");
+                    json_key(&json, "name");
+                    json_string(&json, name);
+                    json_key(&json, "path");
+                    json_string(&json, path);
+                    json_raw(&json, "}");
+                }
+                else
+                    fprintf(out, "%s => %s\n", name, path);
+                if (!add_visit(&closure, library, path, v))
+                {
+                    rv = 3;
+                    goto RET;
+                }
+                found = closure.count;
+            }
+
+            if (!table_add(&closure.names, name, found, err))
+            {
+                rv = 3;
+                goto RET;
+            }
+        }
+    }
+
+    /* The object is written once complete */
+    if (format == FMT_NDJSON)
+    {
+        json_raw(&json, "]");
+        json_key(&json, "missing");
+        json_raw(&json, "[");
+        json_append(&json, &missing);
+        json_raw(&json, "]}");
+        if (!json_flush(&json, out, err))
+            rv = 4;
+    }
+
+  RET:
+    for (v = 0; v < closure.count; v++)
+    {
+        free(closure.visits[v].path);
+        free(closure.visits[v].rpath);
+        free(closure.visits[v].runpath);
+    }
+    free(closure.visits);
+    free(json.data);
+    free(missing.data);
+    free(closure.names.keys);
+    free(closure.names.values);
+    free(closure.libraries.keys);
+    free(closure.libraries.values);
+
+    return rv;
+}
+
+void closure_free(Closure_Memo *memo)
+{
+    Closure_Library *library, *next;
+    size_t i;
+
+    for (i = 0; i < CLOSURE_BUCKETS; i++)
+    {
+        for (library = memo->buckets[i]; library != NULL; library = next)
+        {
+            next = library->next;
+            free(library->dynamics);
+            free(library);
+        }
+    }
+
+    pthread_mutex_destroy(&memo->lock);
+    free(memo);
+}
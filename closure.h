@@ -0,0 +1,39 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Resolve the dependencies of ELF files recursively, the way the loader does.
+ */
+
+#ifndef CLOSURE_H_INCLUDED
+#define CLOSURE_H_INCLUDED
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "dynamic.h"
+#include "scanindex.h"
+
+#define CLOSURE_BUCKETS 1024
+
+/* A file parsed once per run, whatever the number of files depending on it */
+typedef struct Closure_Library
+{
+    dev_t dev;
+    ino_t ino;
+    Dynamics *dynamics; /* NULL if the file can't be loaded */
+    struct Closure_Library *next;
+} Closure_Library;
+
+typedef struct
+{
+    Closure_Library *buckets[CLOSURE_BUCKETS];
+    Scan_Index *index;
+    pthread_mutex_t lock;
+} Closure_Memo;
+
+Closure_Memo* closure_create(Scan_Index *index);
+int closure_query(const LD_Cache *ldcache, Closure_Memo *memo, const char *filename, const Format format, FILE *out, FILE *err);
+void closure_free(Closure_Memo *memo);
+
+#endif
@@ -0,0 +1,404 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Answer the queries from a long-running process, which keeps the cache and the directory listings.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+#include "daemon.h"
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signum)
+{
+    (void)signum;
+    stopping = 1;
+}
+
+static int socket_address(const char *socketname, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+
+    if (strlen(socketname) >= sizeof(address->sun_path))
+    {
+        fputs("The socket name is too long!\n", stderr);
+        return 0;
+    }
+    strcpy(address->sun_path, socketname);
+
+    return 1;
+}
+
+static int read_all(int fd, void *data, size_t length)
+{
+    char *p = data;
+    ssize_t n;
+
+    while (length > 0)
+    {
+        if ((n = read(fd, p, length)) <= 0)
+            return 0;
+        p += n;
+        length -= n;
+    }
+
+    return 1;
+}
+
+static int write_all(int fd, const void *data, size_t length)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (length > 0)
+    {
+        if ((n = write(fd, p, length)) <= 0)
+            return 0;
+        p += n;
+        length -= n;
+    }
+
+    return 1;
+}
+
+/* Only the user of the daemon (or root) may query it, so it never reads a file for someone who couldn't */
+static int trusted(int client)
+{
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0)
+        return 0;
+
+    return peer.uid == geteuid() || peer.uid == 0;
+}
+
+static void answer(LD_Cache *ldcache, int client)
+{
+    Daemon_Request request;
+    Daemon_Response response;
+    char name[PATH_MAX], *outbuf = NULL, *errbuf = NULL;
+    size_t outlen = 0, errlen = 0;
+    FILE *out, *err;
+
+    if (!read_all(client, &request, sizeof(Daemon_Request)) || request.length >= sizeof(name) ||
+        !read_all(client, name, request.length))
+        return;
+    name[request.length] = '\0';
+
+    if ((out = open_memstream(&outbuf, &outlen)) == NULL)
+        return;
+    if ((err = open_memstream(&errbuf, &errlen)) == NULL)
+    {
+        fclose(out);
+        free(outbuf);
+        return;
+    }
+
+    /* Same queries as the command itself, with the cache already in memory */
+    if (!trusted(client))
+    {
+        /* Even if the socket was opened to others since */
+        fputs("Only the user of the daemon can query it!\n", err);
+        response.rv = 2;
+    }
+    else if (ldcache == NULL && (request.query & (QU_MISSING | QU_REPLACEMENT)))
+    {
+        fputs("The cache of the daemon can't be read!\n", err);
+        response.rv = 3;
+    }
+    else if (request.query == QU_NOTHING || (request.query & QU_CLOSURE) ||
+             ((request.query & QU_REPLACEMENT) && request.query != QU_REPLACEMENT))
+    {
+        fputs("The query isn't supported by the daemon!\n", err);
+        response.rv = 5;
+    }
+    else
+        response.rv = dynamics_query(ldcache, NULL, name, (Query)request.query, FMT_TEXT, out, err);
+
+    if (ldcache != NULL)
+        ldcache_clearpath(ldcache);
+
+    fclose(out);
+    fclose(err);
+
+    response.outlen = outlen;
+    response.errlen = errlen;
+    if (write_all(client, &response, sizeof(Daemon_Response)) && write_all(client, outbuf, outlen))
+        write_all(client, errbuf, errlen);
+
+    free(outbuf);
+    free(errbuf);
+}
+
+static void reload(LD_Cache **ldcache, int notify)
+{
+    LD_Cache *fresh;
+
+    /* Keep the previous cache if the new one can't be read (ldconfig may be writing it) */
+    if ((fresh = ldcache_parse(LD_CACHE_PATH)) == NULL)
+        return;
+
+    if (fresh->dirs != NULL)
+        dircache_watch(fresh->dirs, notify);
+
+    /* The new listings are only read when searched, so the watches of the previous ones can go first */
+    if (*ldcache != NULL)
+    {
+        if ((*ldcache)->dirs != NULL)
+            dircache_invalidate((*ldcache)->dirs, -1);
+        ldcache_free(*ldcache);
+    }
+    *ldcache = fresh;
+}
+
+static void handle_events(LD_Cache **ldcache, int notify, int cachewatch, const char *cachename)
+{
+    union
+    {
+        struct inotify_event event;
+        char buffer[16384];
+    } events;
+    const struct inotify_event *event;
+    ssize_t n, pos;
+    int changed = 0;
+
+    while ((n = read(notify, events.buffer, sizeof(events.buffer))) > 0)
+    {
+        for (pos = 0; pos < n; pos += sizeof(struct inotify_event) + event->len)
+        {
+            event = (const struct inotify_event*)(events.buffer + pos);
+
+            /* Some events were lost, nothing can be trusted anymore */
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                changed = 1;
+                if (*ldcache != NULL && (*ldcache)->dirs != NULL)
+                    dircache_invalidate((*ldcache)->dirs, -1);
+                continue;
+            }
+
+            if (event->wd == cachewatch && event->len > 0 && strcmp(event->name, cachename) == 0)
+                changed = 1;
+
+            /* The listing of the directory will be read again when needed */
+            if (*ldcache != NULL && (*ldcache)->dirs != NULL)
+                dircache_invalidate((*ldcache)->dirs, event->wd);
+        }
+    }
+
+    if (changed)
+        reload(ldcache, notify);
+}
+
+int daemon_serve(const char *socketname)
+{
+    struct sockaddr_un address;
+    struct sigaction action;
+    struct pollfd fds[2];
+    struct timeval timeout;
+    LD_Cache *ldcache = NULL;
+    char cachedir[PATH_MAX];
+    const char *cachename = strrchr(LD_CACHE_PATH, '/') + 1;
+    int listener = -1, notify = -1, cachewatch, client, rv = 0;
+    mode_t mask;
+
+    if (!socket_address(socketname, &address))
+        return 1;
+
+    if ((listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    {
+        fprintf(stderr, "Failed to create the socket: %s!\n", strerror(errno));
+        return 3;
+    }
+
+    /* Replace a socket left behind, but not one a daemon is still listening on */
+    if (connect(listener, (struct sockaddr*)&address, sizeof(address)) == 0)
+    {
+        fputs("A daemon is already listening on this socket!\n", stderr);
+        close(listener);
+        return 2;
+    }
+    close(listener);
+    unlink(socketname);
+
+    /* The socket is created private, the other users can't even connect */
+    mask = umask(077);
+    if ((listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+        bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, 64) != 0)
+    {
+        fprintf(stderr, "Failed to listen on the socket: %s!\n", strerror(errno));
+        umask(mask);
+        rv = 3; goto RET;
+    }
+    umask(mask);
+
+    /* Watch the directory of the cache, since ldconfig renames a new cache over it */
+    if ((notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+    {
+        fprintf(stderr, "Failed to watch the files: %s!\n", strerror(errno));
+        rv = 3; goto RET;
+    }
+    sprintf(cachedir, "%.*s", (int)(cachename - 1 - LD_CACHE_PATH), LD_CACHE_PATH);
+    cachewatch = inotify_add_watch(notify, cachedir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+
+    reload(&ldcache, notify);
+
+    /* Stop cleanly, removing the socket */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    fds[1].fd = notify;
+    fds[1].events = POLLIN;
+
+    while (!stopping)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to wait for the requests: %s!\n", strerror(errno));
+            rv = 3;
+            break;
+        }
+
+        /* Apply the changes before answering, so that no answer is stale */
+        if (fds[1].revents & POLLIN)
+            handle_events(&ldcache, notify, cachewatch, cachename);
+
+        if (fds[0].revents & POLLIN)
+        {
+            if ((client = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) == -1)
+                continue;
+
+            /* A silent client mustn't hold the others */
+            timeout.tv_sec = 1;
+            timeout.tv_usec = 0;
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            answer(ldcache, client);
+            close(client);
+        }
+    }
+
+  RET:
+    if (ldcache != NULL)
+        ldcache_free(ldcache);
+    if (notify != -1)
+        close(notify);
+    if (listener != -1)
+    {
+        close(listener);
+        unlink(socketname);
+    }
+
+    return rv;
+}
+
+static int connect_daemon(const char *socketname)
+{
+    struct sockaddr_un address;
+    int fd;
+
+    if (!socket_address(socketname, &address))
+        return -1;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int daemon_available(const char *socketname)
+{
+    int fd;
+
+    /* The daemon drops a connection without request */
+    if ((fd = connect_daemon(socketname)) == -1)
+        return 0;
+
+    close(fd);
+    return 1;
+}
+
+int daemon_query(const char *socketname, const char *filename, const Query query, FILE *out, FILE *err)
+{
+    Daemon_Request request;
+    Daemon_Response response;
+    char path[PATH_MAX], buffer[4096];
+    size_t length;
+    uint32_t remaining;
+    int fd, rv = 3;
+
+    /* The daemon doesn't share the working directory */
+    if (query != QU_REPLACEMENT && filename[0] != '/')
+    {
+        if (getcwd(path, sizeof(path)) == NULL || strlen(path) + strlen(filename) + 2 > sizeof(path))
+            return DAEMON_UNREACHABLE;
+        strcat(path, "/");
+        strcat(path, filename);
+    }
+    else if (strlen(filename) < sizeof(path))
+        strcpy(path, filename);
+    else
+        return DAEMON_UNREACHABLE;
+
+    if ((fd = connect_daemon(socketname)) == -1)
+        return DAEMON_UNREACHABLE;
+
+    length = strlen(path);
+    request.query = query;
+    request.length = length;
+    if (!write_all(fd, &request, sizeof(Daemon_Request)) || !write_all(fd, path, length) ||
+        !read_all(fd, &response, sizeof(Daemon_Response)))
+    {
+        fputs("Failed to query the daemon!\n", err);
+        goto RET;
+    }
+
+    /* Copy both outputs */
+    for (remaining = response.outlen; remaining > 0; remaining -= length)
+    {
+        length = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+        if (!read_all(fd, buffer, length))
+            goto RET;
+        fwrite(buffer, 1, length, out);
+    }
+    for (remaining = response.errlen; remaining > 0; remaining -= length)
+    {
+        length = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+        if (!read_all(fd, buffer, length))
+            goto RET;
+        fwrite(buffer, 1, length, err);
+    }
+    rv = response.rv;
+
+  RET:
+    close(fd);
+    return rv;
+}
@@ -0,0 +1,37 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Answer the queries from a long-running process, which keeps the cache and the directory listings.
+ */
+
+#ifndef DAEMON_H_INCLUDED
+#define DAEMON_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include "dynamic.h"
+
+/* Returned by the client when no daemon answers */
+#define DAEMON_UNREACHABLE -1
+
+/* A request is followed by the name of the file (or of the library) */
+typedef struct
+{
+    uint32_t query;
+    uint32_t length;
+} Daemon_Request;
+
+/* A response is followed by the standard output then the error output */
+typedef struct
+{
+    int32_t rv;
+    uint32_t outlen;
+    uint32_t errlen;
+} Daemon_Response;
+
+int daemon_serve(const char *socketname);
+int daemon_available(const char *socketname);
+int daemon_query(const char *socketname, const char *filename, const Query query, FILE *out, FILE *err);
+
+#endif
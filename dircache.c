@@ -0,0 +1,323 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Provides a cache of directory listings, to check files existence.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <linux/limits.h>
+#include "dircache.h"
+#include "stats.h"
+
+/* States of the listed names */
+#define STATE_PRESENT   0
+#define STATE_UNCHECKED 1
+#define STATE_BROKEN    2
+#define STATE_ABSENT    3   /* Not in the listing */
+#define STATE_UNLISTED  4   /* The directory couldn't be read */
+#define STATE_UNREAD    5   /* The directory wasn't read yet */
+
+static uint32_t hash(const char *str)
+{
+    uint32_t h = 2166136261u;
+
+    /* FNV-1a */
+    while (*str)
+    {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int probe(const char *path, const char *name)
+{
+    char fullpath[PATH_MAX];
+
+    if (snprintf(fullpath, sizeof(fullpath), "%s/%s", path, name) >= (int)sizeof(fullpath))
+        return 0;
+    STATS_COUNT(SC_ACCESS, 1);
+    return access(fullpath, F_OK) == 0;
+}
+
+static int add_name(Dir_Listing *listing, const char *name, unsigned char type, size_t *size, size_t *capacity)
+{
+    const size_t len = strlen(name) + 1;
+    void *grown;
+
+    /* Grow the names */
+    if (*size + len > *capacity)
+    {
+        size_t newCapacity = *capacity == 0 ? 4096 : *capacity * 2;
+        while (*size + len > newCapacity)
+            newCapacity *= 2;
+        if ((grown = realloc(listing->names, newCapacity)) == NULL)
+            return 0;
+        listing->names = grown;
+        *capacity = newCapacity;
+    }
+
+    /* Grow the offsets and the states, from 64 entries by powers of two */
+    if (listing->length == 0 || (listing->length >= 64 && (listing->length & (listing->length - 1)) == 0))
+    {
+        const size_t count = listing->length == 0 ? 64 : listing->length * 2;
+        if ((grown = realloc(listing->offsets, sizeof(uint32_t) * count)) == NULL)
+            return 0;
+        listing->offsets = grown;
+        if ((grown = realloc(listing->states, count)) == NULL)
+            return 0;
+        listing->states = grown;
+    }
+
+    memcpy(listing->names + *size, name, len);
+    listing->offsets[listing->length] = *size;
+
+    /* A symbolic link may be broken, which will be checked when it's looked for */
+    listing->states[listing->length] = (type == DT_LNK || type == DT_UNKNOWN) ? STATE_UNCHECKED : STATE_PRESENT;
+
+    listing->length++;
+    *size += len;
+    return 1;
+}
+
+static void free_listing(Dir_Listing *listing)
+{
+    free(listing->index);
+    free(listing->names);
+    free(listing->offsets);
+    free(listing->states);
+    free(listing->path);
+    free(listing);
+}
+
+static Dir_Listing* read_listing(const char *path, int notify)
+{
+    Dir_Listing *listing;
+    char buffer[32768];
+    ssize_t n, pos;
+    size_t i, slot, size = 0, capacity = 0, indexSize = 16;
+    int fd;
+
+    if ((listing = calloc(1, sizeof(Dir_Listing))) == NULL)
+        return NULL;
+    if ((listing->path = malloc(strlen(path) + 1)) == NULL)
+    {
+        free(listing);
+        return NULL;
+    }
+    strcpy(listing->path, path);
+
+    /* Watch the directory before reading it, so that no change is missed */
+    listing->watch = notify != -1 ? inotify_add_watch(notify, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) : -1;
+
+    /* A directory that can't be read (but may be searched) falls back to probing its names */
+    STATS_COUNT(SC_OPEN, 1);
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    {
+        listing->unlisted = 1;
+        return listing;
+    }
+
+    /* Read the whole directory, by large chunks */
+    while ((n = getdents64(fd, buffer, sizeof(buffer))) > 0)
+    {
+        STATS_COUNT(SC_READ, 1);
+        STATS_COUNT(SC_BYTES_READ, n);
+        for (pos = 0; pos < n; pos += ((struct dirent64*)(buffer + pos))->d_reclen)
+        {
+            const struct dirent64 *entry = (const struct dirent64*)(buffer + pos);
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            if (!add_name(listing, entry->d_name, entry->d_type, &size, &capacity))
+            {
+                close(fd);
+                goto FAIL;
+            }
+        }
+    }
+    close(fd);
+    if (n < 0)
+    {
+        listing->unlisted = 1;
+        return listing;
+    }
+
+    /* Index the names, keeping the load factor under one half */
+    while (indexSize < listing->length * 2)
+        indexSize *= 2;
+    if ((listing->index = calloc(indexSize, sizeof(uint32_t))) == NULL)
+        goto FAIL;
+    listing->indexmask = indexSize - 1;
+
+    for (i = 0; i < listing->length; i++)
+    {
+        slot = hash(listing->names + listing->offsets[i]) & listing->indexmask;
+        while (listing->index[slot] != 0)
+            slot = (slot + 1) & listing->indexmask;
+        listing->index[slot] = i + 1;
+    }
+
+    return listing;
+
+  FAIL:
+    free_listing(listing);
+    return NULL;
+}
+
+Dir_Cache* dircache_create(void)
+{
+    Dir_Cache *cache;
+
+    if ((cache = calloc(1, sizeof(Dir_Cache))) == NULL)
+        return NULL;
+    cache->notify = -1;
+    pthread_rwlock_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+void dircache_watch(Dir_Cache *cache, int notify)
+{
+    cache->notify = notify;
+}
+
+void dircache_invalidate(Dir_Cache *cache, int watch)
+{
+    Dir_Listing **link, *listing;
+    size_t i;
+
+    pthread_rwlock_wrlock(&cache->lock);
+
+    /* A same directory may be listed under several paths, a negative watch drops every listing (and its watch) */
+    for (i = 0; i < DIR_BUCKETS; i++)
+    {
+        for (link = &cache->buckets[i]; (listing = *link) != NULL;)
+        {
+            if (watch < 0 || listing->watch == watch)
+            {
+                if (watch < 0 && listing->watch != -1 && cache->notify != -1)
+                    inotify_rm_watch(cache->notify, listing->watch);
+                *link = listing->next;
+                free_listing(listing);
+            }
+            else
+                link = &listing->next;
+        }
+    }
+
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+static Dir_Listing* find_listing(const Dir_Cache *cache, size_t bucket, const char *path)
+{
+    Dir_Listing *listing;
+
+    for (listing = cache->buckets[bucket]; listing != NULL; listing = listing->next)
+    {
+        if (strcmp(listing->path, path) == 0)
+            break;
+    }
+
+    return listing;
+}
+
+/* The state of the name in the listing of the directory, with its slot for the unchecked ones */
+static int find_state(const Dir_Cache *cache, size_t bucket, const char *path, const char *name, unsigned char **state)
+{
+    const Dir_Listing *listing;
+    size_t slot;
+    uint32_t i;
+
+    if ((listing = find_listing(cache, bucket, path)) == NULL)
+        return STATE_UNREAD;
+    if (listing->unlisted)
+        return STATE_UNLISTED;
+
+    slot = hash(name) & listing->indexmask;
+    while ((i = listing->index[slot]) != 0)
+    {
+        if (strcmp(listing->names + listing->offsets[i - 1], name) == 0)
+        {
+            *state = &listing->states[i - 1];
+            return **state;
+        }
+        slot = (slot + 1) & listing->indexmask;
+    }
+
+    return STATE_ABSENT;
+}
+
+int dircache_contains(Dir_Cache *cache, const char *path, const char *name)
+{
+    Dir_Listing *listing;
+    unsigned char *slot;
+    const size_t bucket = hash(path) % DIR_BUCKETS;
+    int state, found;
+
+    /* Names with a slash can't be found in a listing, neither without a cache */
+    if (cache == NULL || strchr(name, '/') != NULL)
+        return probe(path, name);
+
+    /* The workers search the listings together */
+    pthread_rwlock_rdlock(&cache->lock);
+    state = find_state(cache, bucket, path, name, &slot);
+    pthread_rwlock_unlock(&cache->lock);
+
+    /* Read the directory the first time, without holding the others */
+    if (state == STATE_UNREAD)
+    {
+        if ((listing = read_listing(path, cache->notify)) == NULL)
+            return probe(path, name);
+
+        pthread_rwlock_wrlock(&cache->lock);
+        if (find_listing(cache, bucket, path) == NULL)
+        {
+            listing->next = cache->buckets[bucket];
+            cache->buckets[bucket] = listing;
+        }
+        else
+            free_listing(listing);
+        state = find_state(cache, bucket, path, name, &slot);
+        pthread_rwlock_unlock(&cache->lock);
+    }
+
+    if (state == STATE_UNLISTED)
+        return probe(path, name);
+    if (state != STATE_UNCHECKED)
+        return state == STATE_PRESENT;
+
+    /* Check the link once, the listing may have been dropped meanwhile */
+    found = probe(path, name);
+    pthread_rwlock_wrlock(&cache->lock);
+    if (find_state(cache, bucket, path, name, &slot) == STATE_UNCHECKED)
+        *slot = found ? STATE_PRESENT : STATE_BROKEN;
+    pthread_rwlock_unlock(&cache->lock);
+
+    return found;
+}
+
+void dircache_free(Dir_Cache *cache)
+{
+    Dir_Listing *listing, *next;
+    size_t i;
+
+    for (i = 0; i < DIR_BUCKETS; i++)
+    {
+        for (listing = cache->buckets[i]; listing != NULL; listing = next)
+        {
+            next = listing->next;
+            free_listing(listing);
+        }
+    }
+
+    pthread_rwlock_destroy(&cache->lock);
+    free(cache);
+}
@@ -0,0 +1,44 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Provides a cache of directory listings, to check files existence.
+ */
+
+#ifndef DIRCACHE_H_INCLUDED
+#define DIRCACHE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define DIR_BUCKETS 256
+
+typedef struct Dir_Listing
+{
+    char *path;
+    char *names;
+    unsigned char *states;
+    uint32_t *offsets;
+    uint32_t *index;
+    size_t length;
+    size_t indexmask;
+    int watch;
+    int unlisted;   /* The directory couldn't be read, its names are probed */
+    struct Dir_Listing *next;
+} Dir_Listing;
+
+typedef struct
+{
+    Dir_Listing *buckets[DIR_BUCKETS];
+    int notify;
+    pthread_rwlock_t lock;  /* Written only to insert the listings and their checked states */
+} Dir_Cache;
+
+Dir_Cache* dircache_create(void);
+void dircache_watch(Dir_Cache *cache, int notify);
+void dircache_invalidate(Dir_Cache *cache, int watch);
+int dircache_contains(Dir_Cache *cache, const char *path, const char *name);
+void dircache_free(Dir_Cache *cache);
+
+#endif
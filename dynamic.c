@@ -10,11 +10,35 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/fs.h>
 #include "dynamic.h"
 #include "elffile.h"
+#include "scanindex.h"
+#include "json.h"
+#include "stats.h"
+#include "probes.h"
+#include "patch.h"
+
+typedef struct
+{
+    size_t start;
+    size_t end;
+} Range;
+
+/* The ranges of a buffer modified, to be written back */
+typedef struct
+{
+    Range *ranges;
+    size_t count;
+    size_t capacity;
+    int whole;
+} Dirty;
 
 static size_t available_length(const char *str, const size_t len)
 {
@@ -36,219 +60,464 @@ static size_t available_length(const char *str, const size_t len)
     return len - 1;
 }
 
-static void write_type(char *data, int type)
+static int mark_dirty(Dirty *dirty, size_t start, size_t end)
 {
-    char buffer[8] = { 0 };
-    if (is_e32())
+    Range *grown;
+
+    if (dirty->count == dirty->capacity)
     {
-        int32_t value = type;
-        memcpy(buffer, &value, sizeof(int32_t));
+        const size_t newCapacity = dirty->capacity == 0 ? 16 : dirty->capacity * 2;
+        /* If the range can't be remembered, the whole buffer will be written */
+        if ((grown = realloc(dirty->ranges, sizeof(Range) * newCapacity)) == NULL)
+        {
+            dirty->whole = 1;
+            return 0;
+        }
+        dirty->ranges = grown;
+        dirty->capacity = newCapacity;
+    }
+
+    dirty->ranges[dirty->count].start = start;
+    dirty->ranges[dirty->count].end = end;
+    dirty->count++;
+    return 1;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+    const Range *ra = a, *rb = b;
+    return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
 
-        if (!swap_bytes())
-            (*data) = (*((int32_t*)buffer));
+static void coalesce_dirty(Dirty *dirty)
+{
+    size_t i, n = 0;
+
+    if (dirty->count == 0)
+        return;
+
+    /* Merge the overlapping and adjacent ranges */
+    qsort(dirty->ranges, dirty->count, sizeof(Range), compare_ranges);
+    for (i = 1; i < dirty->count; i++)
+    {
+        if (dirty->ranges[i].start <= dirty->ranges[n].end)
+        {
+            if (dirty->ranges[i].end > dirty->ranges[n].end)
+                dirty->ranges[n].end = dirty->ranges[i].end;
+        }
         else
-            (*data) = bswap_32(*((int32_t*)buffer));
+            dirty->ranges[++n] = dirty->ranges[i];
     }
-    else
+    dirty->count = n + 1;
+}
+
+static const Range* dirty_ranges(Dirty *dirty, size_t length, Range *whole, size_t *count)
+{
+    /* The whole buffer when the ranges couldn't be remembered */
+    if (dirty->whole)
     {
-        int64_t value = type;
-        memcpy(buffer, &value, sizeof(int64_t));
+        whole->start = 0;
+        whole->end = length;
+        *count = 1;
+        return whole;
+    }
 
-        if (!swap_bytes())
-            (*data) = (*((int64_t*)buffer));
-        else
-            (*data) = bswap_64(*((int64_t*)buffer));
+    coalesce_dirty(dirty);
+    *count = dirty->count;
+    return dirty->ranges;
+}
+
+static int write_dirty(int fd, const char *data, size_t offset, size_t length, Dirty *dirty, size_t *written, FILE *err)
+{
+    Range whole;
+    const Range *ranges;
+    size_t i, count;
+
+    ranges = dirty_ranges(dirty, length, &whole, &count);
+
+    /* Write only the changed bytes, at their place in the file */
+    for (i = 0; i < count; i++)
+    {
+        const Range *range = &ranges[i];
+        const size_t len = range->end - range->start;
+
+        STATS_COUNT(SC_WRITE, 1);
+        STATS_COUNT(SC_BYTES_WRITTEN, len);
+        if (pwrite(fd, data + range->start, len, offset + range->start) != (ssize_t)len)
+        {
+            fprintf(err, "Failed to write the changes: %s!\n", strerror(errno));
+            return 0;
+        }
+        *written += len;
     }
+
+    return 1;
 }
 
-static void write_string(char *str, const char *name, const size_t len, const size_t available)
+static int plan_dirty(FILE *plan, int fd, const char *data, size_t offset, size_t length, Dirty *dirty, FILE *err)
 {
+    Range whole;
+    const Range *ranges;
+    size_t i, count;
+
+    ranges = dirty_ranges(dirty, length, &whole, &count);
+
+    /* Describe the changed bytes, instead of writing them */
+    for (i = 0; i < count; i++)
+    {
+        if (!patch_bytes(plan, fd, offset + ranges[i].start, data + ranges[i].start, ranges[i].end - ranges[i].start, err))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void write_tag(const Elf_File *elf, Dirty *dirty, char *dyns, Elf_Dynamic *entries, size_t index, int64_t tag)
+{
+    const size_t entsize = elf->walker->entsize;
+
+    if (entries[index].tag == tag)
+        return;
+
+    entries[index].tag = tag;
+    elf_dynamic_set_tag(elf, dyns, index, tag);
+
+    /* The tag is the first half of the entry */
+    mark_dirty(dirty, entsize * index, entsize * index + entsize / 2);
+}
+
+static void write_string(Dirty *dirty, const char *strtab, char *str, const char *name, const size_t len, const size_t available)
+{
+    size_t first = 0, last = available;
+
+    /* Find the range of bytes that actually change */
+    while (first < available && str[first] == (first < len ? name[first] : '\0'))
+        first++;
+    while (last > first && str[last - 1] == (last - 1 < len ? name[last - 1] : '\0'))
+        last--;
+
     /* Write the string */
     memcpy(str, name, len);
 
     /* Add zeros padding */
     memset(str + len, 0, available - len);
+
+    if (first < last)
+        mark_dirty(dirty, (str - strtab) + first, (str - strtab) + last);
 }
 
-static int write_input_to_output_until(int in, int out, long offset)
+static int find_string_table(const Elf_File *elf, const Elf_Dynamic *entries, const size_t count, size_t *offset, size_t *length)
 {
-    char buffer[1024];
-    long i = 0, l;
+    Elf_Section shdr;
+    uint64_t address = 0, size = 0;
+    size_t k;
 
-    /* Write by chunks of 1024, until the offset is near */
-    while (i + 1024 < offset)
+    /* Prefer the dynamic entries, which don't need the section headers (they may be stripped) */
+    for (k = 0; k < count; k++)
     {
-        if (read(in, buffer, sizeof(buffer)) != sizeof(buffer))
+        if (entries[k].tag == DT_STRTAB)
+            address = entries[k].val;
+        else if (entries[k].tag == DT_STRSZ)
+            size = entries[k].val;
+    }
+
+    /* The address has to be translated to an offset in the file */
+    if (address != 0 && size != 0)
+    {
+        if (elf_find_address(elf, address, size, offset) == 0)
         {
-            fprintf(stderr, "Failed to read from the input file: %s!\n", strerror(errno));
+            *length = size;
             return 0;
         }
-        if (write(out, buffer, sizeof(buffer)) != sizeof(buffer))
+    }
+
+    /* Fall back on the first string table section */
+    if (elf_find_section(elf, SHT_STRTAB, &shdr) != 0)
+        return 1;
+
+    *offset = HDRWU(elf, shdr, sh_offset);
+    *length = HDRWU(elf, shdr, sh_size);
+    return 0;
+}
+
+static int copy_input_to_output(int in, int dst, FILE *err)
+{
+    char buffer[65536];
+    ssize_t n;
+
+    /* Share the extents of the input when the filesystem can do it */
+    if (ioctl(dst, FICLONE, in) == 0)
+        return 1;
+
+    /* Otherwise let the kernel copy the data, without going through the user space */
+    while ((n = copy_file_range(in, NULL, dst, NULL, 1 << 30, 0)) > 0)
+    {
+        STATS_COUNT(SC_WRITE, 1);
+        STATS_COUNT(SC_BYTES_WRITTEN, n);
+    }
+    if (n == 0)
+        return 1;
+
+    /* Older kernels and some filesystems can't copy the ranges, fall back on sendfile */
+    if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+    {
+        while ((n = sendfile(dst, in, NULL, 1 << 30)) > 0)
         {
-            fprintf(stderr, "Failed to write to the output file: %s!\n", strerror(errno));
-            return 0;
+            STATS_COUNT(SC_WRITE, 1);
+            STATS_COUNT(SC_BYTES_WRITTEN, n);
+        }
+        if (n == 0)
+            return 1;
+    }
+
+    /* And at last on regular reads and writes */
+    if (errno == EINVAL || errno == ENOSYS)
+    {
+        while ((n = read(in, buffer, sizeof(buffer))) > 0)
+        {
+            STATS_COUNT(SC_READ, 1);
+            STATS_COUNT(SC_BYTES_READ, n);
+            STATS_COUNT(SC_WRITE, 1);
+            STATS_COUNT(SC_BYTES_WRITTEN, n);
+            if (write(dst, buffer, n) != n)
+            {
+                fprintf(err, "Failed to write to the output file: %s!\n", strerror(errno));
+                return 0;
+            }
         }
-        i += 1024;
+        if (n == 0)
+            return 1;
     }
 
-    /* Compute the remaining length */
-    l = offset - i;
+    fprintf(err, "Failed to copy the input file: %s!\n", strerror(errno));
+    return 0;
+}
+
+static int open_sibling(const char *filename, char *target, char *tmpname, FILE *err)
+{
+    char *slash;
+    int fd;
 
-    if (read(in, buffer, l) != l)
+    /* Resolve the links, so that the file they point to is replaced and not them */
+    if (realpath(filename, target) == NULL)
     {
-        fprintf(stderr, "Failed to read from the input file: %s!\n", strerror(errno));
-        return 0;
+        fprintf(err, "Failed to resolve the path of the file: %s!\n", strerror(errno));
+        return -1;
     }
-    if (write(out, buffer, l) != l)
+
+    /* The copy has to be in the same directory, for the renaming to be atomic */
+    slash = strrchr(target, '/');
+    sprintf(tmpname, "%.*s/.%s.XXXXXX", (int)(slash - target), target, slash + 1);
+    if ((fd = mkstemp(tmpname)) == -1)
     {
-        fprintf(stderr, "Failed to write to the output file: %s!\n", strerror(errno));
-        return 0;
+        fprintf(err, "Failed to create the temporary file: %s!\n", strerror(errno));
+        tmpname[0] = '\0';
     }
+    else
+        STATS_COUNT(SC_OPEN, 1);
 
-    return 1;
+    return fd;
 }
 
-static int write_input_to_output_end(int in, int out)
+static int copy_attributes(int in, int dst, FILE *err)
 {
-    char buffer[1024];
-    long i, l, end;
+    struct stat stats;
+    char *names = NULL, *name, *value = NULL;
+    ssize_t length, size, capacity = 0;
+    void *grown;
+    int rv = 0;
 
-    /* Get the end position of the file */
-    i = lseek(in, 0, SEEK_CUR);
-    end = lseek(in, 0, SEEK_END);
-    lseek(in, i, SEEK_SET);
+    if (fstat(in, &stats) != 0)
+    {
+        fprintf(err, "Failed to read the stats of the input file: %s!\n", strerror(errno));
+        return 0;
+    }
 
-    /* Write by chunks of 1024, until the end */
-    while (i + 1024 < end)
+    /* The owner has to be changed first, since it may clear the set-user-ID bits */
+    if (fchown(dst, stats.st_uid, stats.st_gid) != 0)
     {
-        if (read(in, buffer, sizeof(buffer)) != sizeof(buffer))
-        {
-            fprintf(stderr, "Failed to read from the input file: %s!\n", strerror(errno));
-            return 0;
-        }
-        if (write(out, buffer, sizeof(buffer)) != sizeof(buffer))
+        fprintf(err, "Failed to preserve the owner of the file: %s!\n", strerror(errno));
+        return 0;
+    }
+    if (fchmod(dst, stats.st_mode & 07777) != 0)
+    {
+        fprintf(err, "Failed to preserve the permissions of the file: %s!\n", strerror(errno));
+        return 0;
+    }
+
+    /* Copy the extended attributes, if the filesystem has some */
+    if ((length = flistxattr(in, NULL, 0)) == 0 || (length < 0 && errno == ENOTSUP))
+        return 1;
+    if (length < 0 || (names = malloc(length)) == NULL || (length = flistxattr(in, names, length)) < 0)
+    {
+        fprintf(err, "Failed to list the extended attributes: %s!\n", strerror(errno));
+        goto RET;
+    }
+
+    for (name = names; name < names + length; name += strlen(name) + 1)
+    {
+        if ((size = fgetxattr(in, name, NULL, 0)) < 0)
+            goto XATTR;
+        if (size > capacity)
         {
-            fprintf(stderr, "Failed to write to the output file: %s!\n", strerror(errno));
-            return 0;
+            if ((grown = realloc(value, size)) == NULL)
+                goto XATTR;
+            value = grown;
+            capacity = size;
         }
-        i += 1024;
+        if ((size = fgetxattr(in, name, value, size)) < 0 || fsetxattr(dst, name, value, size, 0) != 0)
+            goto XATTR;
     }
+    rv = 1;
+    goto RET;
+
+  XATTR:
+    fprintf(err, "Failed to preserve the extended attribute %s: %s!\n", name, strerror(errno));
 
-    /* Compute the remaining length */
-    l = end - i;
+  RET:
+    free(names);
+    free(value);
+    return rv;
+}
+
+static int replace_file(int in, int dst, const char *target, const char *tmpname, const Write_Mode mode, FILE *err)
+{
+    char directory[PATH_MAX];
+    int fd;
+
+    if (!copy_attributes(in, dst, err))
+        return 0;
 
-    if (read(in, buffer, l) != l)
+    /* The copies of a batch are flushed together, before any of them replaces its file */
+    if (mode == WR_ATOMIC_LAZY)
+        return 1;
+
+    /* The content has to be on the disk before the name points to it */
+    if (mode == WR_ATOMIC && fsync(dst) != 0)
     {
-        fprintf(stderr, "Failed to read from the input file: %s!\n", strerror(errno));
+        fprintf(err, "Failed to flush the temporary file: %s!\n", strerror(errno));
         return 0;
     }
-    if (write(out, buffer, l) != l)
+
+    if (rename(tmpname, target) != 0)
     {
-        fprintf(stderr, "Failed to write to the output file: %s!\n", strerror(errno));
+        fprintf(err, "Failed to replace the file: %s!\n", strerror(errno));
         return 0;
     }
 
+    /* Then the renaming itself */
+    if (mode == WR_ATOMIC)
+    {
+        sprintf(directory, "%.*s", (int)(strrchr(target, '/') - target), target);
+        if ((fd = open(directory[0] != '\0' ? directory : "/", O_RDONLY | O_DIRECTORY)) != -1)
+        {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
     return 1;
 }
 
-int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *filename, const char *output, const Replacement *replacements, const char *soname, const char *rpath, int fix)
+int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *filename, const char *output, const Replacement *replacements, const char *soname, const char *rpath, int fix, const Write_Mode mode, char **copy, FILE *plan, FILE *out, FILE *err)
 {
-    Elf_Header ehdr;
-    Elf_Section shdr;
+    Elf_File elf;
     Elf_Program phdr;
-    size_t phdrlen, shdrlen, slotnum = 0, slots[2], slotstr[2], slotlen[2] = { 0 };
+    char target[PATH_MAX], tmpname[PATH_MAX + 16] = "";
+    size_t phdrlen, shdrlen, shdroff, slotnum = 0, slots[2], slotstr[2], slotlen[2] = { 0 };
     char *dyns = NULL, *strtab = NULL, *sname = NULL, *name;
-    int in = -1, out = -1, rv = 0, dynsmod = 0, needmod = 0, somod = 0, rmod = 0, i, j, l, last;
-    const int modifications = (replacements[0].old || soname || rpath || fix > 1);
+    Elf_Dynamic *entries = NULL;
+    size_t count, k;
+    Dirty strDirty = { NULL, 0, 0, 0 }, dynsDirty = { NULL, 0, 0, 0 };
+    uint64_t started = 0;
+    size_t written = 0;
+    int in = -1, dst = -1, rv = 0, dynsmod = 0, needmod = 0, somod = 0, rmod = 0, j, l, last;
+    const int modifications = (replacements[0].old || soname || rpath || fix > 1 || priority != PRI_UNCHANGED);
+
+    STATS_START(started);
 
     /* Open the output file */
     if (output && modifications)
     {
-        if ((out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 600)) == -1)
+        if ((dst = open(output, O_WRONLY | O_CREAT | O_TRUNC, 600)) == -1)
         {
-            fprintf(stderr, "Failed to open the output file: %s!\n", strerror(errno));
+            fprintf(err, "Failed to open the output file: %s!\n", strerror(errno));
             rv = 4; goto RET;
         }
+        STATS_COUNT(SC_OPEN, 1);
     }
 
     /* Open the input ELF file */
-    if ((in = elf_open(filename, out == -1 ? O_RDWR : O_RDONLY, &ehdr)) == -1)
+    if ((in = elf_open(&elf, filename, dst == -1 && mode == WR_INPLACE && plan == NULL ? O_RDWR : O_RDONLY, err)) == -1)
         return 3;
+    STATS_LAP(ST_OPEN, started);
 
     /* Set the output file permissions */
-    if (out != -1)
+    if (dst != -1)
     {
         struct stat stats;
 
         if (fstat(in, &stats) != 0)
         {
-            fprintf(stderr, "Failed to read the stats of the input file: %s!\n", strerror(errno));
+            fprintf(err, "Failed to read the stats of the input file: %s!\n", strerror(errno));
             rv = 3; goto RET;
         }
-        if (fchmod(out, stats.st_mode) != 0)
+        if (fchmod(dst, stats.st_mode) != 0)
         {
-            fprintf(stderr, "Failed to change the permissions of the output file: %s!\n", strerror(errno));
+            fprintf(err, "Failed to change the permissions of the output file: %s!\n", strerror(errno));
             rv = 3; goto RET;
         }
     }
 
     /* Find the dynamic section */
-    if (elf_find_program(in, PT_DYNAMIC, &ehdr, &phdr) != 0)
+    if (elf_find_program(&elf, PT_DYNAMIC, &phdr) != 0)
     {
         rv = 3;
         goto RET;
     }
 
-    /* Allocate the dynamic section */
-    phdrlen = HDRWU(phdr, p_filesz);
-    if ((dyns = malloc(phdrlen)) == NULL)
+    /* Access the dynamic section */
+    phdrlen = HDRWU(&elf, phdr, p_filesz);
+    if ((dyns = elf_data(&elf, HDRWU(&elf, phdr, p_offset), phdrlen)) == NULL)
     {
-        fprintf(stderr, "Failed to allocate memory for dynamic section: %s!\n", strerror(errno));
+        fputs("Failed to read dynamic section!\n", err);
         rv = 3; goto RET;
     }
+    STATS_LAP(ST_LOOKUP, started);
 
-    /* Read the dynamic section */
-    memset(dyns, 0, phdrlen);
-    if (lseek(in, HDRWU(phdr, p_offset), SEEK_SET) == -1
-      || read(in, dyns, phdrlen) != (ssize_t)phdrlen)
-    {
-        fprintf(stderr, "Failed to read dynamic section: %s!\n", strerror(errno));
-        rv = 3; goto RET;
-    }
-
-    /* Find the string table section */
-    if (elf_find_section(in, SHT_STRTAB, &ehdr, &shdr) != 0)
+    /* Decode the dynamic entries */
+    if ((entries = elf_dynamic(&elf, dyns, phdrlen, &count)) == NULL)
     {
         rv = 3;
         goto RET;
     }
+    STATS_LAP(ST_WALK, started);
 
-    /* Allocate the dynamic section */
-    shdrlen = HDRWU(shdr, sh_size);
-    if ((strtab = malloc(shdrlen)) == NULL)
+    /* Find the string table */
+    if (find_string_table(&elf, entries, count, &shdroff, &shdrlen) != 0)
     {
-        fprintf(stderr, "Failed to allocate memory for string table: %s!\n", strerror(errno));
-        rv = 3; goto RET;
+        rv = 3;
+        goto RET;
     }
 
-    /* Read the dynamic section */
-    memset(strtab, 0, shdrlen);
-    if (lseek(in, HDRWU(shdr, sh_offset), SEEK_SET) == -1
-      || read(in, strtab, shdrlen) != (ssize_t)shdrlen)
+    /* Access the string table */
+    if ((strtab = elf_data(&elf, shdroff, shdrlen)) == NULL)
     {
-        fprintf(stderr, "Failed to read string table: %s!\n", strerror(errno));
+        fputs("Failed to read string table!\n", err);
         rv = 3; goto RET;
     }
+    STATS_LAP(ST_LOOKUP, started);
+    PROBE2(dyngler, walk_start, filename, count);
 
     /* If no modifications have to be done, just print infos about the dynamics */
     if (modifications)
     {
-        printf("Processing file: %s\n", filename);
+        fprintf(out, "Processing file: %s\n", filename);
         last = -2;
     }
     else if (fix == 0)
     {
-        printf("[ELF dynamic table informations]\n  File: %s\n", filename);
+        fprintf(out, "[ELF dynamic table informations]\n  File: %s\n", filename);
         last = -1;
     }
     else
@@ -260,54 +529,39 @@ int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *fil
      */
     if (soname > REMOVAL || rpath > REMOVAL)
     {
-        i = 0;
-        while (i < phdrlen)
+        for (k = 0; k < count; k++)
         {
-            switch (SWAPS(&dyns[i]))
-            {
-                case DT_DEBUG:
-                    /* Check if the value points outside of the string table (which may be) */
-                    if (SWAPU(&dyns[i]) > shdrlen)
-                        goto DEFAULT;
-
-                    /* Pick the slot with the minimum current length */
-                    l = slotlen[0] > slotlen[1] ? 1 : 0;
-                    slots[l] = i;
-                    ADV(i, 1);
-                    slotstr[l] = SWAPU(&dyns[i]);
-                    name = &strtab[SWAPU(&dyns[i])];
-                    ADV(i, 1);
-
-                    /* Compute the available length of the slot */
-                    slotlen[l] = available_length(name, shdrlen - (name - strtab));
-                    slotnum++;
-                    break;
-              DEFAULT:
-                default:
-                ADV(i, 2);
-                    break;
-            }
+            /* Check if the value points outside of the string table (which may be) */
+            if (entries[k].tag != DT_DEBUG || entries[k].val >= shdrlen)
+                continue;
+
+            /* Pick the slot with the minimum current length */
+            l = slotlen[0] > slotlen[1] ? 1 : 0;
+            slots[l] = k;
+            slotstr[l] = entries[k].val;
+            name = &strtab[entries[k].val];
+
+            /* Compute the available length of the slot */
+            slotlen[l] = available_length(name, shdrlen - (name - strtab));
+            slotnum++;
         }
     }
 
     /* Process the dynamic entries */
-    i = 0;
-    while (i < phdrlen)
+    for (k = 0; k < count; k++)
     {
-        switch (SWAPS(&dyns[i]))
+        switch (entries[k].tag)
         {
             case DT_NEEDED:
                 /* Retrieve the library name */
-                ADV(i, 1);
-                name = &strtab[SWAPU(&dyns[i])];
-                ADV(i, 1);
+                name = &strtab[entries[k].val];
 
                 if (last > -2)
                 {
                     if (last != 0)
-                        puts("");
+                        fputc('\n', out);
                     last = 0;
-                    printf("· Needed: %s\n", name);
+                    fprintf(out, "· Needed: %s\n", name);
                     break;
                 }
 
@@ -336,38 +590,35 @@ int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *fil
                     const size_t available = available_length(name, shdrlen - (name - strtab));
                     if (len > available)
                     {
-                        fputs("The new name is too big to fit!\n", stderr);
+                        PROBE3(dyngler, replacement, filename, name, NULL);
+                        fputs("The new name is too big to fit!\n", err);
                         break;
                     }
 
-                    printf("Replacing needed: %s => %s...\n", replacement->old, replacement->new);
+                    PROBE3(dyngler, replacement, filename, name, replacement->new);
+                    fprintf(out, "Replacing needed: %s => %s...\n", replacement->old, replacement->new);
 
                     /* Check if the new name is in the cache */
                     if (ldcache != NULL)
                     {
                         if (!ldcache_search(ldcache, replacement->new))
-                            fprintf(stderr, "Warning! The library name %s was not found in the cache!\nYou might want to run `ldconfig`.\n", replacement->new);
+                            fprintf(err, "Warning! The library name %s was not found in the cache!\nYou might want to run `ldconfig`.\n", replacement->new);
                     }
 
                     /* Write in the string table */
-                    write_string(name, replacement->new, len, available);
+                    write_string(&strDirty, strtab, name, replacement->new, len, available);
                 }
                 break;
             case DT_SONAME:
-                /* Save the offset of the type */
-                j = i;
-
                 /* Retrieve the SO name */
-                ADV(i, 1);
-                name = &strtab[SWAPU(&dyns[i])];
-                ADV(i, 1);
+                name = &strtab[entries[k].val];
 
                 if (last > -2)
                 {
                     if (last != 1)
-                        puts("");
+                        fputc('\n', out);
                     last = 1;
-                    printf("· Soname: %s\n", name);
+                    fprintf(out, "· Soname: %s\n", name);
                     break;
                 }
 
@@ -378,8 +629,8 @@ int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *fil
                     /* If to be removed, replace the type with DT_DEBUG */
                     if (soname == REMOVAL)
                     {
-                        puts("Removing soname entry...");
-                        write_type(&dyns[j], DT_DEBUG);
+                        fputs("Removing soname entry...\n", out);
+                        write_tag(&elf, &dynsDirty, dyns, entries, k, DT_DEBUG);
                         dynsmod = 1;
                         break;
                     }
@@ -389,47 +640,42 @@ int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *fil
                     const size_t available = available_length(name, shdrlen - (name - strtab));
                     if (len > available)
                     {
-                        fputs("The new soname is too big to fit!\n", stderr);
+                        fputs("The new soname is too big to fit!\n", err);
                         break;
                     }
 
-                    printf("Setting soname: %s...\n", soname);
+                    fprintf(out, "Setting soname: %s...\n", soname);
 
                     /* Write in the string table */
-                    write_string(name, soname, len, available);
+                    write_string(&strDirty, strtab, name, soname, len, available);
                 }
                 break;
             case DT_RPATH:
                 /* Change the type if priority doesn't match */
                 if (priority == PRI_RUNPATH)
                 {
-                    fputs("Changing run-time priority to low...\n", stderr);
-                    write_type(&dyns[i], DT_RUNPATH);
+                    fputs("Changing run-time priority to low...\n", err);
+                    write_tag(&elf, &dynsDirty, dyns, entries, k, DT_RUNPATH);
                     dynsmod = 1;
                 }
             case DT_RUNPATH:
                 /* Change the type if priority doesn't match */
                 if (priority == PRI_RPATH)
                 {
-                    fputs("Changing run-time priority to high...\n", stderr);
-                    write_type(&dyns[i], DT_RPATH);
+                    fputs("Changing run-time priority to high...\n", err);
+                    write_tag(&elf, &dynsDirty, dyns, entries, k, DT_RPATH);
                     dynsmod = 1;
                 }
 
-                /* Save the offset of the type */
-                j = i;
-
                 /* Retrieve the run-time path */
-                ADV(i, 1);
-                sname = &strtab[SWAPU(&dyns[i])];
-                ADV(i, 1);
+                sname = &strtab[entries[k].val];
 
                 if (last > -2)
                 {
                     if (last != 2)
-                        puts("");
+                        fputc('\n', out);
                     last = 2;
-                    printf("· Run-time path: %s\n", sname);
+                    fprintf(out, "· Run-time path: %s\n", sname);
                     break;
                 }
 
@@ -440,8 +686,8 @@ int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *fil
                     /* If to be removed, replace the type with DT_DEBUG */
                     if (rpath == REMOVAL)
                     {
-                        puts("Removing run-time path entry...");
-                        write_type(&dyns[j], DT_DEBUG);
+                        fputs("Removing run-time path entry...\n", out);
+                        write_tag(&elf, &dynsDirty, dyns, entries, k, DT_DEBUG);
                         dynsmod = 1;
                         break;
                     }
@@ -451,18 +697,17 @@ int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *fil
                     const size_t available = available_length(sname, shdrlen - (sname - strtab));
                     if (len > available)
                     {
-                        fputs("The new run-time path is too big to fit!\n", stderr);
+                        fputs("The new run-time path is too big to fit!\n", err);
                         break;
                     }
 
-                    printf("Setting run-time path: %s...\n", rpath);
+                    fprintf(out, "Setting run-time path: %s...\n", rpath);
 
                     /* Write in the string table */
-                    write_string(sname, rpath, len, available);
+                    write_string(&strDirty, strtab, sname, rpath, len, available);
                 }
                 break;
             default:
-                ADV(i, 2);
                 break;
         }
     }
@@ -482,16 +727,16 @@ int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *fil
             const size_t len = strlen(soname);
             const size_t available = slotlen[l];
             if (len > available)
-                fputs("The new run-time path is too big to fit!\n", stderr);
+                fputs("The new run-time path is too big to fit!\n", err);
             else
             {
-                printf("Adding soname: %s...\n", soname);
-                write_type(&dyns[slots[l]], DT_SONAME);
+                fprintf(out, "Adding soname: %s...\n", soname);
+                write_tag(&elf, &dynsDirty, dyns, entries, slots[l], DT_SONAME);
                 dynsmod = 1;
 
                 /* Write in the string table */
                 name = &strtab[slotstr[l]];
-                write_string(name, soname, len, available);
+                write_string(&strDirty, strtab, name, soname, len, available);
             }
         }
         else if (rpath > REMOVAL && !rmod)
@@ -506,22 +751,25 @@ int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *fil
             const size_t len = strlen(rpath);
             const size_t available = slotlen[l];
             if (len > available)
-                fputs("The new run-time path is too big to fit!\n", stderr);
+                fputs("The new run-time path is too big to fit!\n", err);
             else
             {
-                printf("Adding run-time path: %s...\n", rpath);
-                write_type(&dyns[slots[l]], priority == PRI_RUNPATH ? DT_RUNPATH : DT_RPATH);
+                fprintf(out, "Adding run-time path: %s...\n", rpath);
+                write_tag(&elf, &dynsDirty, dyns, entries, slots[l], priority == PRI_RUNPATH ? DT_RUNPATH : DT_RPATH);
                 dynsmod = 1;
 
                 /* Write in the string table */
                 name = &strtab[slotstr[l]];
-                write_string(name, rpath, len, available);
+                write_string(&strDirty, strtab, name, rpath, len, available);
             }
         }
         else
             slotnum--;
     }
 
+    STATS_LAP(ST_WALK, started);
+    PROBE2(dyngler, walk_end, filename, count);
+
     /* Perform late automatic fixing, if requested */
     if (fix != 0 && ldcache != NULL)
     {
@@ -529,18 +777,15 @@ int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *fil
         if (sname != NULL)
         {
             if (!ldcache_setpath(ldcache, sname, filename))
-                fprintf(stderr, "Failed to allocate memory for the stored path: %s!\n", strerror(errno));
+                fprintf(err, "Failed to allocate memory for the stored path: %s!\n", strerror(errno));
         }
 
-        i = 0;
-        while (i < phdrlen)
+        for (k = 0; k < count; k++)
         {
-            if (SWAPS(&dyns[i]) == DT_NEEDED)
+            if (entries[k].tag == DT_NEEDED)
             {
                 /* Retrieve the library name */
-                ADV(i, 1);
-                name = &strtab[SWAPU(&dyns[i])];
-                ADV(i, 1);
+                name = &strtab[entries[k].val];
 
                 /* Search it in the cache */
                 if (ldcache_search(ldcache, name))
@@ -548,285 +793,484 @@ int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *fil
 
                 /* Find the closest library matching it's name and being slim enough */
                 const size_t available = available_length(name, shdrlen - (name - strtab));
-                const char *newName = ldcache_replacement(ldcache, name);
+                const char *newName = ldcache_replacement(ldcache, name, available);
+                PROBE3(dyngler, replacement, filename, name, newName);
                 if (newName == NULL)
                 {
-                    fprintf(stderr, "Failed to find a replacement for %s\n", name);
-                    continue;
-                }
-                if (strlen(newName) > available)
-                {
-                    fputs("The replacement found was too big to fit!\n", stderr);
+                    if (ldcache_replacement(ldcache, name, LD_ANY_LENGTH) != NULL)
+                        fputs("The replacement found was too big to fit!\n", err);
+                    else
+                        fprintf(err, "Failed to find a replacement for %s\n", name);
                     continue;
                 }
 
                 needmod = 1;
-                printf("Fixing needed: %s => %s...\n", name, newName);
+                fprintf(out, "Fixing needed: %s => %s...\n", name, newName);
 
                 /* Write in the string table */
-                write_string(name, newName, strlen(newName), available);
+                write_string(&strDirty, strtab, name, newName, strlen(newName), available);
             }
-            else
-                ADV(i, 2);
         }
     }
 
+    STATS_LAP(ST_RESOLVE, started);
+
     /* Write the output file */
-    if (needmod || somod || rmod)
+    if (needmod || somod || rmod || dynsmod)
     {
-        if (out == -1)
+        if (plan != NULL)
         {
-            /* Position to the offset of the string table section */
-            if (lseek(in, HDRWU(shdr, sh_offset), SEEK_SET) == -1)
+            /* The file is left as it is, the plan tells how to change it (if anything fitted) */
+            if ((strDirty.count > 0 || strDirty.whole || dynsDirty.count > 0 || dynsDirty.whole)
+              && (!patch_file(plan, filename, in, err)
+               || !plan_dirty(plan, in, strtab, shdroff, shdrlen, &strDirty, err)
+               || !plan_dirty(plan, in, dyns, HDRWU(&elf, phdr, p_offset), phdrlen, &dynsDirty, err)))
             {
-                fprintf(stderr, "Failed to position to the string table: %s!\n", strerror(errno));
-                rv = 4; goto RET;
-            }
-
-            /* Write the modified string table */
-            if (write(in, strtab, shdrlen) != shdrlen)
-            {
-                fprintf(stderr, "Failed to write to the string table: %s!\n", strerror(errno));
-                rv = 4; goto RET;
+                rv = 4;
+                goto RET;
             }
-
-            if (dynsmod)
+        }
+        else if (dst == -1 && mode == WR_INPLACE)
+        {
+            /* Write back only the bytes that changed */
+            if (!write_dirty(in, strtab, shdroff, shdrlen, &strDirty, &written, err)
+              || !write_dirty(in, dyns, HDRWU(&elf, phdr, p_offset), phdrlen, &dynsDirty, &written, err))
             {
-                /* Position to the offset of the dynamic section */
-                if (lseek(in, HDRWU(phdr, p_offset), SEEK_SET) == -1)
-                {
-                    fprintf(stderr, "Failed to position to the dynamic section: %s!\n", strerror(errno));
-                    rv = 4; goto RET;
-                }
-
-                /* Write the modified dynamic section */
-                if (write(in, dyns, phdrlen) != phdrlen)
-                {
-                    fprintf(stderr, "Failed to write to the dynamic section: %s!\n", strerror(errno));
-                    rv = 4; goto RET;
-                }
+                rv = 4;
+                goto RET;
             }
         }
         else
         {
-            /* Position to the beginning of the input file */
-            lseek(in, 0, SEEK_SET);
-
-            /* Copy the data until the string table section */
-            if (!write_input_to_output_until(in, out, HDRWU(shdr, sh_offset)))
+            /* Patch a copy next to the file, which replaces it at once */
+            if (dst == -1 && (dst = open_sibling(filename, target, tmpname, err)) == -1)
             {
                 rv = 4;
                 goto RET;
             }
 
-            /* Write the string table section */
-            if (write(out, strtab, shdrlen) != shdrlen)
+            /* Copy the whole input, then apply the changes on top of it */
+            if (!copy_input_to_output(in, dst, err)
+              || !write_dirty(dst, strtab, shdroff, shdrlen, &strDirty, &written, err)
+              || !write_dirty(dst, dyns, HDRWU(&elf, phdr, p_offset), phdrlen, &dynsDirty, &written, err))
             {
-                fprintf(stderr, "Failed to write to the string table: %s!\n", strerror(errno));
-                rv = 4; goto RET;
-            }
-
-            /* Advance the input until the end of the string table section */
-            if (lseek(in, shdrlen, SEEK_CUR) == -1)
-            {
-                fprintf(stderr, "Failed to advance in the input file: %s!\n", strerror(errno));
-                rv = 4; goto RET;
+                rv = 4;
+                goto RET;
             }
 
-            if (dynsmod)
+            if (tmpname[0] != '\0')
             {
-                /* Copy the data until the dynamic section */
-                if (!write_input_to_output_until(in, out, HDRWU(phdr, p_offset) - lseek(in, 0, SEEK_CUR)))
+                if (!replace_file(in, dst, target, tmpname, mode, err))
                 {
                     rv = 4;
                     goto RET;
                 }
-
-                /* Write the dynamic section */
-                if (write(out, dyns, phdrlen) != phdrlen)
-                {
-                    fprintf(stderr, "Failed to write to the dynamic section: %s!\n", strerror(errno));
-                    rv = 4; goto RET;
-                }
-
-                /* Advance the input until the end of the dynamic section */
-                if (lseek(in, phdrlen, SEEK_CUR) == -1)
+                if (mode == WR_ATOMIC_LAZY)
                 {
-                    fprintf(stderr, "Failed to advance in the input file: %s!\n", strerror(errno));
-                    rv = 4; goto RET;
+                    if ((*copy = malloc(strlen(tmpname) + 1)) == NULL)
+                    {
+                        fprintf(err, "Failed to allocate memory for the name of the copy: %s!\n", strerror(errno));
+                        rv = 3;
+                        goto RET;
+                    }
+                    strcpy(*copy, tmpname);
                 }
-            }
-
-            /* Copy the rest of the data */
-            if (!write_input_to_output_end(in, out))
-            {
-                rv = 4;
-                goto RET;
+                tmpname[0] = '\0';
             }
         }
     }
 
+    STATS_LAP(ST_WRITE, started);
+    if (written > 0)
+        PROBE2(dyngler, write_back, filename, written);
+
     /* Warn if something wanted to be done, but nothing actually was */
     if (replacements[0].old && !needmod)
-        fprintf(stderr, "Warning! No needed library with name %s was found.\n", replacements[0].old);
+        fprintf(err, "Warning! No needed library with name %s was found.\n", replacements[0].old);
     if (soname && !somod)
-        fputs("Warning! No available section was found to modify soname.\n", stderr);
+        fputs("Warning! No available section was found to modify soname.\n", err);
     if (rpath && !rmod)
-        fputs("Warning! No available section was found to modify run-time path.\n", stderr);
+        fputs("Warning! No available section was found to modify run-time path.\n", err);
 
   RET:
     if (in != -1)
-        elf_close(in);
+    {
+        if (strtab != NULL)
+            elf_data_free(&elf, strtab);
+        if (dyns != NULL)
+            elf_data_free(&elf, dyns);
+        elf_close(&elf);
+    }
 
-    if (out != -1)
-        close(out);
+    free(entries);
+    free(strDirty.ranges);
+    free(dynsDirty.ranges);
 
-    free(strtab);
-    free(dyns);
+    if (dst != -1)
+        close(dst);
+
+    /* Don't leave the copy behind if it couldn't replace the file */
+    if (tmpname[0] != '\0')
+        unlink(tmpname);
 
     return rv;
 }
 
-int dynamics_query(LD_Cache *ldcache, const char *filename, const Query query)
+int dynamics_replace(const char *copy, FILE *err)
 {
-    Elf_Header ehdr;
-    Elf_Section shdr;
-    Elf_Program phdr;
-    size_t phdrlen, shdrlen;
-    char *dyns = NULL, *strtab = NULL;
-    const char *name;
-    int in = -1, rv = 0, i, once, type, typealt;
+    char target[PATH_MAX + 16];
+    const char *slash = strrchr(copy, '/');
 
-    /* If the query is about a library name, no need to open the input file */
-    if (query == QU_REPLACEMENT)
+    /* The copy is named after its file, see open_sibling */
+    sprintf(target, "%.*s/%.*s", (int)(slash - copy), copy, (int)strlen(slash + 2) - 7, slash + 2);
+    if (rename(copy, target) != 0)
     {
-        name = ldcache_replacement(ldcache, filename);
-        if (name)
-        {
-            puts(name);
-            return 0;
-        }
-        fprintf(stderr, "Failed to find a replacement for %s\n", filename);
-        return 5;
+        fprintf(err, "Failed to replace the file %s: %s!\n", target, strerror(errno));
+        return 0;
     }
 
+    return 1;
+}
+
+static const char* dynamic_string(const char *strtab, size_t length, uint64_t offset)
+{
+    /* The string has to be terminated inside the table */
+    if (offset >= length || memchr(strtab + offset, '\0', length - offset) == NULL)
+        return NULL;
+
+    return strtab + offset;
+}
+
+Dynamics* dynamics_read(const char *filename, FILE *err)
+{
+    Elf_File elf;
+    Elf_Program phdr;
+    size_t phdrlen, shdrlen, shdroff;
+    char *dyns = NULL, *strtab = NULL, *strings;
+    const char *str;
+    Elf_Dynamic *entries = NULL;
+    Dynamics *dynamics = NULL;
+    size_t count, k, needed = 0, size = 0;
+    uint64_t started = 0;
+
+    STATS_START(started);
+
     /* Open the input ELF file */
-    if ((in = elf_open(filename, O_RDONLY, &ehdr)) == -1)
-        return 3;
+    if (elf_open(&elf, filename, O_RDONLY, err) == -1)
+        return NULL;
+    STATS_LAP(ST_OPEN, started);
 
     /* Find the dynamic section */
-    if (elf_find_program(in, PT_DYNAMIC, &ehdr, &phdr) != 0)
+    if (elf_find_program(&elf, PT_DYNAMIC, &phdr) != 0)
+        goto RET;
+
+    /* Access the dynamic section */
+    phdrlen = HDRWU(&elf, phdr, p_filesz);
+    if ((dyns = elf_data(&elf, HDRWU(&elf, phdr, p_offset), phdrlen)) == NULL)
     {
-        rv = 3;
+        fputs("Failed to read dynamic section!\n", err);
         goto RET;
     }
+    STATS_LAP(ST_LOOKUP, started);
+
+    /* Decode the dynamic entries */
+    if ((entries = elf_dynamic(&elf, dyns, phdrlen, &count)) == NULL)
+        goto RET;
+    STATS_LAP(ST_WALK, started);
 
-    /* Allocate the dynamic section */
-    phdrlen = HDRWU(phdr, p_filesz);
-    if ((dyns = malloc(phdrlen)) == NULL)
+    /* Find and access the string table */
+    if (find_string_table(&elf, entries, count, &shdroff, &shdrlen) != 0)
+        goto RET;
+    if ((strtab = elf_data(&elf, shdroff, shdrlen)) == NULL)
     {
-        fprintf(stderr, "Failed to allocate memory for dynamic section: %s!\n", strerror(errno));
-        rv = 3; goto RET;
+        fputs("Failed to read string table!\n", err);
+        goto RET;
     }
+    STATS_LAP(ST_LOOKUP, started);
+    PROBE2(dyngler, walk_start, filename, count);
 
-    /* Read the dynamic section */
-    memset(dyns, 0, phdrlen);
-    if (lseek(in, HDRWU(phdr, p_offset), SEEK_SET) == -1
-      || read(in, dyns, phdrlen) != (ssize_t)phdrlen)
+    /* Measure the strings to keep */
+    for (k = 0; k < count; k++)
     {
-        fprintf(stderr, "Failed to read dynamic section: %s!\n", strerror(errno));
-        rv = 3; goto RET;
+        switch (entries[k].tag)
+        {
+            case DT_NEEDED:
+                needed++;
+                /* Fall below */
+            case DT_SONAME:
+            case DT_RPATH:
+            case DT_RUNPATH:
+                if ((str = dynamic_string(strtab, shdrlen, entries[k].val)) != NULL)
+                    size += strlen(str) + 1;
+                break;
+            default:
+                break;
+        }
     }
 
-    /* Find the string table section */
-    if (elf_find_section(in, SHT_STRTAB, &ehdr, &shdr) != 0)
+    if ((dynamics = calloc(1, sizeof(Dynamics) + sizeof(char*) * needed + size)) == NULL)
     {
-        rv = 3;
+        fprintf(err, "Failed to allocate memory for the dynamic strings: %s!\n", strerror(errno));
         goto RET;
     }
+    dynamics->needed = (const char**)(dynamics + 1);
+    strings = (char*)(dynamics->needed + needed);
 
-    /* Allocate the dynamic section */
-    shdrlen = HDRWU(shdr, sh_size);
-    if ((strtab = malloc(shdrlen)) == NULL)
+    /* Copy the strings */
+    for (k = 0; k < count; k++)
     {
-        fprintf(stderr, "Failed to allocate memory for string table: %s!\n", strerror(errno));
-        rv = 3; goto RET;
+        const int64_t t = entries[k].tag;
+
+        if (t != DT_NEEDED && t != DT_SONAME && t != DT_RPATH && t != DT_RUNPATH)
+            continue;
+        if ((str = dynamic_string(strtab, shdrlen, entries[k].val)) == NULL)
+            continue;
+
+        strcpy(strings, str);
+        if (t == DT_NEEDED)
+            dynamics->needed[dynamics->neededlen++] = strings;
+        else if (t == DT_SONAME)
+            dynamics->soname = strings;
+        else if (t == DT_RPATH)
+            dynamics->rpath = strings;
+        else
+            dynamics->runpath = strings;
+        strings += strlen(str) + 1;
     }
 
-    /* Read the dynamic section */
-    memset(strtab, 0, shdrlen);
-    if (lseek(in, HDRWU(shdr, sh_offset), SEEK_SET) == -1
-      || read(in, strtab, shdrlen) != (ssize_t)shdrlen)
+    dynamics->machine = HDRHU(&elf, elf.ehdr, e_machine);
+    dynamics->e32 = elf.e32;
+    STATS_LAP(ST_WALK, started);
+    PROBE2(dyngler, walk_end, filename, count);
+
+  RET:
+    if (strtab != NULL)
+        elf_data_free(&elf, strtab);
+    if (dyns != NULL)
+        elf_data_free(&elf, dyns);
+    elf_close(&elf);
+
+    free(entries);
+
+    return dynamics;
+}
+
+int dynamics_room(const char *filename, const Replacement *replacements, size_t count, size_t *available, FILE *err)
+{
+    Elf_File elf;
+    Elf_Program phdr;
+    size_t phdrlen, shdrlen, shdroff, entrycount, k, j;
+    char *dyns = NULL, *strtab = NULL;
+    const char *str;
+    Elf_Dynamic *entries = NULL;
+    int rv = 3;
+
+    /* A name not found again can always be replaced by a shorter one */
+    for (j = 0; j < count; j++)
+        available[j] = strlen(replacements[j].old);
+
+    if (elf_open(&elf, filename, O_RDONLY, err) == -1)
+        return 3;
+
+    if (elf_find_program(&elf, PT_DYNAMIC, &phdr) != 0)
+        goto RET;
+    phdrlen = HDRWU(&elf, phdr, p_filesz);
+    if ((dyns = elf_data(&elf, HDRWU(&elf, phdr, p_offset), phdrlen)) == NULL)
     {
-        fprintf(stderr, "Failed to read string table: %s!\n", strerror(errno));
-        rv = 3; goto RET;
+        fputs("Failed to read dynamic section!\n", err);
+        goto RET;
+    }
+    if ((entries = elf_dynamic(&elf, dyns, phdrlen, &entrycount)) == NULL)
+        goto RET;
+    if (find_string_table(&elf, entries, entrycount, &shdroff, &shdrlen) != 0)
+        goto RET;
+    if ((strtab = elf_data(&elf, shdroff, shdrlen)) == NULL)
+    {
+        fputs("Failed to read string table!\n", err);
+        goto RET;
     }
 
-    /* Determine the query type */
-    switch (query)
+    /* The room of a name runs until the next string, as when the file is repaired */
+    for (k = 0; k < entrycount; k++)
     {
-        /* If querying the missing, search for the rpath */
-        case QU_MISSING:
-            i = 0;
-            while (i < phdrlen)
-            {
-                switch (SWAPS(&dyns[i]))
-                {
-                    case DT_RPATH:
-                    case DT_RUNPATH:
-                        ADV(i, 1);
-                        if (!ldcache_setpath(ldcache, &strtab[SWAPU(&dyns[i])], filename))
-                        {
-                            rv = 3; goto RET;
-                        }
-                        goto EXIT;
-                    default:
-                        ADV(i, 2);
-                }
-            }
-        EXIT: /* Fall below */
-        case QU_NEEDED: type = typealt = DT_NEEDED; once = 0; break;
-        case QU_SONAME: type = typealt = DT_SONAME; once = 1; break;
-        case QU_RPATH: type = DT_RPATH; typealt = DT_RUNPATH; once = 1; break;
-        default: rv = 5; goto RET;
+        if (entries[k].tag != DT_NEEDED || (str = dynamic_string(strtab, shdrlen, entries[k].val)) == NULL)
+            continue;
+        for (j = 0; j < count; j++)
+        {
+            if (strcmp(str, replacements[j].old) == 0)
+                available[j] = available_length(str, shdrlen - (str - strtab));
+        }
+    }
+    rv = 0;
+
+  RET:
+    if (strtab != NULL)
+        elf_data_free(&elf, strtab);
+    if (dyns != NULL)
+        elf_data_free(&elf, dyns);
+    elf_close(&elf);
+
+    free(entries);
+
+    return rv;
+}
+
+static int query_print(const LD_Cache *ldcache, const char *label, const char *name, FILE *out)
+{
+    /* If the library is found in the cache / rpath, don't print it */
+    if (name == NULL || (ldcache != NULL && ldcache_search(ldcache, name)))
+        return 0;
+
+    /* Write the raw output, labelled when several queries are answered */
+    if (label != NULL)
+        fprintf(out, "%s: %s\n", label, name);
+    else
+        fprintf(out, "%s\n", name);
+    return 1;
+}
+
+static int query_json(LD_Cache *ldcache, const Dynamics *dynamics, const char *filename, FILE *out, FILE *err)
+{
+    Json_Buffer json = { NULL, 0, 0, 0 };
+    size_t k, n;
+
+    json_raw(&json, "{");
+    json_key(&json, "file");
+    json_string(&json, filename);
+    json_key(&json, "soname");
+    json_string(&json, dynamics->soname);
+    json_key(&json, "rpath");
+    json_string(&json, dynamics->rpath);
+    json_key(&json, "runpath");
+    json_string(&json, dynamics->runpath);
+
+    json_key(&json, "needed");
+    json_raw(&json, "[");
+    for (k = 0; k < dynamics->neededlen; k++)
+    {
+        if (k > 0)
+            json_raw(&json, ",");
+        json_string(&json, dynamics->needed[k]);
     }
+    json_raw(&json, "]");
 
-    /* Query the dynamic entries */
-    i = 0;
-    while (i < phdrlen)
+    /* The missing libraries need the cache, and the run-time path to be set */
+    if (ldcache != NULL)
     {
-        const int t = SWAPS(&dyns[i]);
-        if (t == type || t == typealt)
+        json_key(&json, "missing");
+        json_raw(&json, "[");
+        for (k = n = 0; k < dynamics->neededlen; k++)
         {
-            /* Retrieve the library name */
-            ADV(i, 1);
-            name = &strtab[SWAPU(&dyns[i])];
-            ADV(i, 1);
+            if (ldcache_search(ldcache, dynamics->needed[k]))
+                continue;
+            if (n++ > 0)
+                json_raw(&json, ",");
+            json_string(&json, dynamics->needed[k]);
+        }
+        json_raw(&json, "]");
 
-            /* If the library is found in the cache / rpath, don't print it */
-            if (ldcache != NULL)
-            {
-                if (ldcache_search(ldcache, name))
-                    continue;
-            }
+        json_key(&json, "replacements");
+        json_raw(&json, "{");
+        for (k = 0; k < dynamics->neededlen; k++)
+        {
+            if (ldcache_search(ldcache, dynamics->needed[k]))
+                continue;
+            json_key(&json, dynamics->needed[k]);
+            json_string(&json, ldcache_replacement(ldcache, dynamics->needed[k], LD_ANY_LENGTH));
+        }
+        json_raw(&json, "}");
+    }
 
-            /* Write the raw output */
-            puts(name);
+    json_raw(&json, "}");
 
-            /* If only one can be present */
-            if (once)
-                break;
+    return json_flush(&json, out, err) ? 0 : 4;
+}
+
+int dynamics_query(LD_Cache *ldcache, struct Scan_Index *index, const char *filename, const Query query, const Format format, FILE *out, FILE *err)
+{
+    Dynamics *dynamics;
+    const char *name, *path;
+    size_t k;
+    uint64_t started = 0;
+    int several, rv = 0;
+
+    /* If the query is about a library name, no need to open the input file */
+    if (query == QU_REPLACEMENT)
+    {
+        STATS_START(started);
+        name = ldcache_replacement(ldcache, filename, LD_ANY_LENGTH);
+        STATS_LAP(ST_RESOLVE, started);
+        if (format == FMT_NDJSON)
+        {
+            Json_Buffer json = { NULL, 0, 0, 0 };
+
+            json_raw(&json, "{");
+            json_key(&json, "name");
+            json_string(&json, filename);
+            json_key(&json, "replacement");
+            json_string(&json, name);
+            json_raw(&json, "}");
+            if (!json_flush(&json, out, err))
+                return 4;
+            return name ? 0 : 5;
+        }
+        if (name)
+        {
+            fprintf(out, "%s\n", name);
+            return 0;
         }
+        fprintf(err, "Failed to find a replacement for %s\n", filename);
+        return 5;
+    }
+
+    /* Read the dynamic strings, or their copy in the index if the file didn't change */
+    if ((dynamics = scanindex_read(index, filename, err)) == NULL)
+        return 3;
+
+    /* The "runpath" is the one used when both are present */
+    path = dynamics->runpath != NULL ? dynamics->runpath : dynamics->rpath;
+
+    /* A single object holds the answers to all the queries */
+    if (format == FMT_NDJSON)
+    {
+        STATS_START(started);
+        if (ldcache != NULL && path != NULL && !ldcache_setpath(ldcache, path, filename))
+            rv = 3;
         else
-            ADV(i, 2);
+            rv = query_json(ldcache, dynamics, filename, out, err);
+        STATS_LAP(ST_RESOLVE, started);
+        free(dynamics);
+        return rv;
     }
 
-  RET:
-    if (in != -1)
-        elf_close(in);
+    /* Answer every query from the same strings, in a fixed order */
+    several = (query & (query - 1)) != 0;
+    if (query & QU_SONAME)
+        query_print(NULL, several ? "soname" : NULL, dynamics->soname, out);
+    if (query & QU_RPATH)
+        query_print(NULL, several ? "rpath" : NULL, path, out);
+    if (query & QU_NEEDED)
+    {
+        for (k = 0; k < dynamics->neededlen; k++)
+            query_print(NULL, several ? "needed" : NULL, dynamics->needed[k], out);
+    }
+    /* If querying the missing, search for the rpath */
+    if (query & QU_MISSING)
+    {
+        STATS_START(started);
+        if (ldcache != NULL && path != NULL && !ldcache_setpath(ldcache, path, filename))
+            rv = 3;
+        else
+        {
+            for (k = 0; k < dynamics->neededlen; k++)
+                query_print(ldcache, several ? "missing" : NULL, dynamics->needed[k], out);
+        }
+        STATS_LAP(ST_RESOLVE, started);
+    }
+    if (query & ~(QU_NEEDED | QU_MISSING | QU_SONAME | QU_RPATH))
+        rv = 5;
 
-    free(strtab);
-    free(dyns);
+    free(dynamics);
 
     return rv;
 }
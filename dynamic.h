@@ -8,6 +8,7 @@
 #ifndef DYNAMIC_H_INCLUDED
 #define DYNAMIC_H_INCLUDED
 
+#include <stdio.h>
 #include "ldcache.h"
 
 /* Special value to mean the removal of the property */
@@ -21,23 +22,56 @@ typedef enum
     PRI_RPATH
 } Priority;
 
+/* The queries on a file can be combined, and are answered from a single read */
 typedef enum
 {
-    QU_NOTHING,
-    QU_NEEDED,
-    QU_MISSING,
-    QU_SONAME,
-    QU_RPATH,
-    QU_REPLACEMENT
+    QU_NOTHING     = 0x00,
+    QU_NEEDED      = 0x01,
+    QU_MISSING     = 0x02,
+    QU_SONAME      = 0x04,
+    QU_RPATH       = 0x08,
+    QU_REPLACEMENT = 0x10, /* Only on library names, alone */
+    QU_CLOSURE     = 0x20, /* Alone */
+    QU_DEPENDENTS  = 0x40  /* Alone, answered from the index */
 } Query;
 
+typedef enum
+{
+    WR_INPLACE,     /* Patch the file where it lies */
+    WR_ATOMIC,      /* Patch a copy of the file, flush it, then rename it over the file */
+    WR_ATOMIC_LAZY  /* Patch a copy of the file, left to the caller to flush then rename over the file */
+} Write_Mode;
+
+typedef enum
+{
+    FMT_TEXT,
+    FMT_NDJSON
+} Format;
+
+/* The dynamic strings of a file, in a single allocation */
+typedef struct
+{
+    const char *soname;
+    const char *rpath;
+    const char *runpath;
+    const char **needed;
+    size_t neededlen;
+    uint16_t machine;
+    int e32;
+} Dynamics;
+
 typedef struct
 {
     const char *old;
     const char *new;
 } Replacement;
 
-int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *filename, const char *output, const Replacement *replacements, const char *soname, const char *rpath, int fix);
-int dynamics_query(LD_Cache *ldcache, const char *filename, const Query query);
+int dynamics_process(LD_Cache *ldcache, const Priority priority, const char *filename, const char *output, const Replacement *replacements, const char *soname, const char *rpath, int fix, const Write_Mode mode, char **copy, FILE *plan, FILE *out, FILE *err);
+int dynamics_replace(const char *copy, FILE *err);
+struct Scan_Index;
+
+Dynamics* dynamics_read(const char *filename, FILE *err);
+int dynamics_room(const char *filename, const Replacement *replacements, size_t count, size_t *available, FILE *err);
+int dynamics_query(LD_Cache *ldcache, struct Scan_Index *index, const char *filename, const Query query, const Format format, FILE *out, FILE *err);
 
 #endif
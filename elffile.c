@@ -6,39 +6,92 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <elf.h>
 #include <errno.h>
 #include "elffile.h"
+#include "stats.h"
+#include "probes.h"
 
-#define EHDR_PWS(x) (is_e32() ? DO_SWAPS32(ehdr->e32.x) : DO_SWAPS64(ehdr->e64.x))
-#define EHDR_PHS(x) (is_e32() ? DO_SWAPS16(ehdr->e32.x) : DO_SWAPS16(ehdr->e64.x))
-#define PHDR_PWS(x) (is_e32() ? DO_SWAPS32(phdr->e32.x) : DO_SWAPS64(phdr->e64.x))
-#define EHDR_PWU(x) (is_e32() ? DO_SWAPU32(ehdr->e32.x) : DO_SWAPU64(ehdr->e64.x))
-#define EHDR_PHU(x) (is_e32() ? DO_SWAPU16(ehdr->e32.x) : DO_SWAPU16(ehdr->e64.x))
-#define PHDR_PWU(x) (is_e32() ? DO_SWAPU32(phdr->e32.x) : DO_SWAPU32(phdr->e64.x))
-#define PHDR_POU(x) (is_e32() ? DO_SWAPU32(phdr->e32.x) : DO_SWAPU64(phdr->e64.x))
-#define SHDR_POU(x) (is_e32() ? DO_SWAPU32(shdr->e32.x) : DO_SWAPU32(shdr->e64.x))
+#define EHDR_PWS(x) HDRWS(elf, elf->ehdr, x)
+#define EHDR_PHS(x) HDRHS(elf, elf->ehdr, x)
+#define EHDR_PWU(x) HDRWU(elf, elf->ehdr, x)
+#define EHDR_PHU(x) HDRHU(elf, elf->ehdr, x)
+#define PHDR_PWU(x) (elf->e32 ? DO_SWAPU32(elf, phdr->e32.x) : DO_SWAPU32(elf, phdr->e64.x))
+#define PHDR_POU(x) HDRWU(elf, *phdr, x)
+#define SHDR_PWU(x) (elf->e32 ? DO_SWAPU32(elf, shdr->e32.x) : DO_SWAPU32(elf, shdr->e64.x))
+#define SHDR_POU(x) HDRWU(elf, *shdr, x)
 
-static int is_e32_flag;
-static int swap_bytes_flag;
+#define NO_SWAP(x) (x)
 
-int is_e32(void)
-{
-    return is_e32_flag;
+/* Define the dynamic array functions for one class and one byte order.
+ * This way, the class and the byte order are tested once per file, and not for each entry.
+ * The entries are copied, since the segment of a mapped file may be at any offset.
+ */
+#define DEFINE_WALKER(name, Dyn, Sword, Word, SWAP) \
+static void decode_##name(const char *data, size_t count, Elf_Dynamic *entries) \
+{ \
+    Dyn dyn; \
+    size_t i; \
+    for (i = 0; i < count; i++) \
+    { \
+        memcpy(&dyn, data + sizeof(Dyn) * i, sizeof(Dyn)); \
+        entries[i].tag = (Sword)SWAP((Word)dyn.d_tag); \
+        entries[i].val = (Word)SWAP((Word)dyn.d_un.d_val); \
+    } \
+} \
+static void set_tag_##name(char *data, size_t index, int64_t tag) \
+{ \
+    Dyn dyn; \
+    memcpy(&dyn, data + sizeof(Dyn) * index, sizeof(Dyn)); \
+    dyn.d_tag = (Sword)SWAP((Word)tag); \
+    memcpy(data + sizeof(Dyn) * index, &dyn, sizeof(Dyn)); \
 }
 
-int swap_bytes(void)
+DEFINE_WALKER(e32_native, Elf32_Dyn, int32_t, uint32_t, NO_SWAP)
+DEFINE_WALKER(e32_swapped, Elf32_Dyn, int32_t, uint32_t, bswap_32)
+DEFINE_WALKER(e64_native, Elf64_Dyn, int64_t, uint64_t, NO_SWAP)
+DEFINE_WALKER(e64_swapped, Elf64_Dyn, int64_t, uint64_t, bswap_64)
+
+/* Indexed by class (32 bits or not) then byte order (swapped or not) */
+static const Elf_Walker walkers[2][2] =
 {
-    return swap_bytes_flag;
+    {
+        { sizeof(Elf64_Dyn), decode_e64_native, set_tag_e64_native },
+        { sizeof(Elf64_Dyn), decode_e64_swapped, set_tag_e64_swapped }
+    },
+    {
+        { sizeof(Elf32_Dyn), decode_e32_native, set_tag_e32_native },
+        { sizeof(Elf32_Dyn), decode_e32_swapped, set_tag_e32_swapped }
+    }
+};
+
+static int read_at(const Elf_File *elf, void *buffer, size_t length, size_t offset)
+{
+    /* Copy from the mapping if there is one */
+    if (elf->map != NULL)
+    {
+        if (offset > elf->size || length > elf->size - offset)
+            return 0;
+        memcpy(buffer, elf->map + offset, length);
+        return 1;
+    }
+
+    STATS_COUNT(SC_READ, 1);
+    STATS_COUNT(SC_BYTES_READ, length);
+    return pread(elf->fd, buffer, length, offset) == (ssize_t)length;
 }
 
-int elf_open(const char *filename, int flags, Elf_Header *ehdr)
+int elf_open(Elf_File *elf, const char *filename, int flags, FILE *err)
 {
+    Elf_Header *ehdr = &elf->ehdr;
+    struct stat stats;
     int fd;
     size_t headerSize;
     size_t partSize;
@@ -46,15 +99,40 @@ int elf_open(const char *filename, int flags, Elf_Header *ehdr)
     /* Open the file */
     if ((fd = open(filename, flags)) == -1)
     {
-        fprintf(stderr, "Failed to open file: %s!\n", strerror(errno));
+        fprintf(err, "Failed to open file: %s!\n", strerror(errno));
         return -1;
     }
+    STATS_COUNT(SC_OPEN, 1);
+    PROBE2(dyngler, file_open, filename, fd);
+
+    elf->err = err;
+    elf->fd = fd;
+    elf->map = NULL;
+    elf->size = (size_t)-1;
+
+    /* Map the whole file privately, so that it can be edited in memory and written back.
+     * Inputs that can't be mapped are read instead.
+     */
+    STATS_COUNT(SC_STAT, 1);
+    if (fstat(fd, &stats) == 0 && S_ISREG(stats.st_mode))
+    {
+        elf->size = stats.st_size;
+        if (elf->size >= EI_NIDENT)
+        {
+            STATS_COUNT(SC_MAP, 1);
+            elf->map = mmap(NULL, elf->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (elf->map == MAP_FAILED)
+                elf->map = NULL;
+            else
+                STATS_COUNT(SC_BYTES_MAPPED, elf->size);
+        }
+    }
 
     /* Read the identifier */
-    if (read(fd, ehdr, EI_NIDENT) != EI_NIDENT)
+    if (!read_at(elf, ehdr, EI_NIDENT, 0))
     {
-        fprintf(stderr, "Failed to read ELF header: %s!\n", strerror(errno));
-        close(fd);
+        fprintf(err, "Failed to read ELF header: %s!\n", strerror(errno));
+        elf_close(elf);
         return -1;
     }
 
@@ -66,119 +144,212 @@ int elf_open(const char *filename, int flags, Elf_Header *ehdr)
         ehdr->id[EI_DATA]  != ELFDATA2MSB) ||
         ehdr->id[EI_VERSION] != EV_CURRENT)
     {
-        fprintf(stderr, "File %s probably isn't an ELF file.\n", filename);
-        close(fd);
+        fprintf(err, "File %s probably isn't an ELF file.\n", filename);
+        elf_close(elf);
         return -1;
     }
 
     /* Set the flags */
-    is_e32_flag = ehdr->id[EI_CLASS] == ELFCLASS32;
-    swap_bytes_flag = ehdr->id[EI_DATA] != ELFDATA2;
+    elf->e32 = ehdr->id[EI_CLASS] == ELFCLASS32;
+    elf->swap = ehdr->id[EI_DATA] != ELFDATA2;
+    elf->walker = &walkers[elf->e32][elf->swap];
 
     /* Read the ELF header */
-    headerSize = is_e32() ? sizeof(Elf32_Ehdr) : sizeof(Elf64_Ehdr);
-    if (read(fd, ((char*)ehdr) + EI_NIDENT, headerSize - EI_NIDENT) != (ssize_t)(headerSize - EI_NIDENT))
+    headerSize = elf->e32 ? sizeof(Elf32_Ehdr) : sizeof(Elf64_Ehdr);
+    if (!read_at(elf, ((char*)ehdr) + EI_NIDENT, headerSize - EI_NIDENT, EI_NIDENT))
     {
-        fprintf(stderr, "Failed to read full ELF header: %s!\n", strerror(errno));
-        close(fd);
+        fprintf(err, "Failed to read full ELF header: %s!\n", strerror(errno));
+        elf_close(elf);
         return -1;
     }
 
     /* Read the parts header */
-    partSize = is_e32() ? sizeof(Elf32_Phdr) : sizeof(Elf64_Phdr);
+    partSize = elf->e32 ? sizeof(Elf32_Phdr) : sizeof(Elf64_Phdr);
     if ((size_t)EHDR_PHS(e_phentsize) != partSize)
     {
-        fprintf(stderr, "section size was read as %zd, not %zd!\n", (size_t)EHDR_PHS(e_phentsize), partSize);
-        close(fd);
+        fprintf(err, "section size was read as %zd, not %zd!\n", (size_t)EHDR_PHS(e_phentsize), partSize);
+        elf_close(elf);
         return -1;
     }
 
     return fd;
 }
 
-int elf_find_program(int fd, uint32_t type, const Elf_Header *ehdr, Elf_Program *phdr)
+char* elf_data(const Elf_File *elf, size_t offset, size_t length)
 {
-    int i;
-    const size_t prgSize = is_e32() ? sizeof(Elf32_Phdr) : sizeof(Elf64_Phdr);
+    char *data;
 
-    /* Position for sections */
-    if (lseek(fd, EHDR_PWU(e_phoff), SEEK_SET) == -1)
+    if (offset > elf->size || length > elf->size - offset)
     {
-        fprintf(stderr, "Failed to position for sections: %s!\n", strerror(errno));
-        return 1;
+        fputs("The data lies outside of the file.\n", elf->err);
+        return NULL;
+    }
+
+    /* Access the data in place when the file is mapped */
+    if (elf->map != NULL)
+        return elf->map + offset;
+
+    if ((data = malloc(length > 0 ? length : 1)) == NULL)
+    {
+        fprintf(elf->err, "Failed to allocate memory for the data: %s!\n", strerror(errno));
+        return NULL;
+    }
+    STATS_COUNT(SC_READ, 1);
+    STATS_COUNT(SC_BYTES_READ, length);
+    if (pread(elf->fd, data, length, offset) != (ssize_t)length)
+    {
+        fprintf(elf->err, "Failed to read the data: %s!\n", strerror(errno));
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+void elf_data_free(const Elf_File *elf, char *data)
+{
+    if (elf->map == NULL)
+        free(data);
+}
+
+Elf_Dynamic* elf_dynamic(const Elf_File *elf, const char *data, size_t length, size_t *count)
+{
+    Elf_Dynamic *entries;
+
+    /* Decode the whole dynamic array at once */
+    *count = length / elf->walker->entsize;
+    if ((entries = malloc(sizeof(Elf_Dynamic) * (*count > 0 ? *count : 1))) == NULL)
+    {
+        fprintf(elf->err, "Failed to allocate memory for the dynamic entries: %s!\n", strerror(errno));
+        return NULL;
     }
+    elf->walker->decode(data, *count, entries);
+
+    return entries;
+}
+
+void elf_dynamic_set_tag(const Elf_File *elf, char *data, size_t index, int64_t tag)
+{
+    elf->walker->set_tag(data, index, tag);
+}
+
+int elf_find_program(const Elf_File *elf, uint32_t type, Elf_Program *phdr)
+{
+    FILE *err = elf->err;
+    const char *table;
+    int i;
+    const int count = EHDR_PHS(e_phnum);
+    const size_t prgSize = elf->e32 ? sizeof(Elf32_Phdr) : sizeof(Elf64_Phdr);
+
+    /* Access the whole table at once */
+    if ((table = elf_data(elf, EHDR_PWU(e_phoff), prgSize * count)) == NULL)
+        return 1;
 
     /* Iterate through sections */
-    for (i = 0; i < EHDR_PHS(e_phnum); i++)
+    for (i = 0; i < count; i++)
     {
-        if (read(fd, phdr, prgSize) != (ssize_t)prgSize)
-        {
-            fprintf(stderr, "Failed to read section header: %s!\n", strerror(errno));
-            return 1;
-        }
+        memcpy(phdr, table + prgSize * i, prgSize);
 
         /* Stop at the the chosen section */
         if (PHDR_PWU(p_type) == type)
             break;
     }
 
-    if (EHDR_PHS(e_phnum) == i)
+    elf_data_free(elf, (char*)table);
+
+    if (count == i)
     {
-        fputs("No section found.\n", stderr);
+        fputs("No section found.\n", err);
         return 2;
     }
 
     if (PHDR_POU(p_filesz) == 0)
     {
-        fputs("Length of section is zero.\n", stderr);
+        fputs("Length of section is zero.\n", err);
         return 3;
     }
 
     return 0;
 }
 
-int elf_find_section(int fd, uint32_t type, const Elf_Header *ehdr, Elf_Section *shdr)
+int elf_find_address(const Elf_File *elf, uint64_t address, uint64_t length, size_t *offset)
 {
+    Elf_Program program, *const phdr = &program;
+    const char *table;
     int i;
-    const size_t secSize = is_e32() ? sizeof(Elf32_Shdr) : sizeof(Elf64_Shdr);
+    const int count = EHDR_PHS(e_phnum);
+    const size_t prgSize = elf->e32 ? sizeof(Elf32_Phdr) : sizeof(Elf64_Phdr);
 
-    /* Position for sections */
-    if (lseek(fd, EHDR_PWU(e_shoff), SEEK_SET) == -1)
-    {
-        fprintf(stderr, "Failed to position for sections: %s!\n", strerror(errno));
+    if ((table = elf_data(elf, EHDR_PWU(e_phoff), prgSize * count)) == NULL)
         return 1;
+
+    /* Search for the loaded segment containing the whole range */
+    for (i = 0; i < count; i++)
+    {
+        uint64_t vaddr, filesz;
+
+        memcpy(phdr, table + prgSize * i, prgSize);
+        if (PHDR_PWU(p_type) != PT_LOAD)
+            continue;
+
+        vaddr = PHDR_POU(p_vaddr);
+        filesz = PHDR_POU(p_filesz);
+        if (address < vaddr || address - vaddr > filesz || length > filesz - (address - vaddr))
+            continue;
+
+        *offset = PHDR_POU(p_offset) + (address - vaddr);
+        break;
     }
 
+    elf_data_free(elf, (char*)table);
+
+    return i == count ? 2 : 0;
+}
+
+int elf_find_section(const Elf_File *elf, uint32_t type, Elf_Section *shdr)
+{
+    FILE *err = elf->err;
+    const char *table;
+    int i;
+    const int count = EHDR_PHU(e_shnum);
+    const size_t secSize = elf->e32 ? sizeof(Elf32_Shdr) : sizeof(Elf64_Shdr);
+
+    /* Access the whole table at once */
+    if ((table = elf_data(elf, EHDR_PWU(e_shoff), secSize * count)) == NULL)
+        return 1;
+
     /* Iterate through sections */
-    for (i = 0; i < EHDR_PHU(e_shnum); i++)
+    for (i = 0; i < count; i++)
     {
-        if (read(fd, shdr, secSize) != (ssize_t)secSize)
-        {
-            fprintf(stderr, "Failed to read section header: %s!\n", strerror(errno));
-            return 1;
-        }
+        memcpy(shdr, table + secSize * i, secSize);
 
         /* Stop at the the chosen section */
-        if (SHDR_POU(sh_type) == type)
+        if (SHDR_PWU(sh_type) == type)
             break;
     }
 
-    if (EHDR_PHU(e_shnum) == i)
+    elf_data_free(elf, (char*)table);
+
+    if (count == i)
     {
-        fputs("No section found.\n", stderr);
+        fputs("No section found.\n", err);
         return 2;
     }
 
     if (SHDR_POU(sh_size) == 0)
     {
-        fputs("Length of section is zero.\n", stderr);
+        fputs("Length of section is zero.\n", err);
         return 3;
     }
 
     return 0;
 }
 
-void elf_close(int fd)
+void elf_close(Elf_File *elf)
 {
-    close(fd);
+    if (elf->map != NULL)
+        munmap(elf->map, elf->size);
+    close(elf->fd);
+    elf->map = NULL;
+    elf->fd = -1;
 }
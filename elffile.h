@@ -8,6 +8,7 @@
 #ifndef ELFFILE_H_INCLUDED
 #define ELFFILE_H_INCLUDED
 
+#include <stdio.h>
 #include <byteswap.h>
 #include <elf.h>
 
@@ -37,32 +38,54 @@ typedef union
     Elf64_Phdr e64;
 } Elf_Program;
 
-int is_e32(void);
-int swap_bytes(void);
+/* A dynamic entry, decoded to the native representation */
+typedef struct
+{
+    int64_t tag;
+    uint64_t val;
+} Elf_Dynamic;
 
-#define DO_SWAPU16(x) ( !swap_bytes() ? x : (uint16_t)bswap_16(x) )
-#define DO_SWAPU32(x) ( !swap_bytes() ? x : (uint32_t)bswap_32(x) )
-#define DO_SWAPU64(x) ( !swap_bytes() ? x : (uint64_t)bswap_64(x) )
-#define DO_SWAPS16(x) ( !swap_bytes() ? x : (int16_t)bswap_16(x) )
-#define DO_SWAPS32(x) ( !swap_bytes() ? x : (int32_t)bswap_32(x) )
-#define DO_SWAPS64(x) ( !swap_bytes() ? x : (int64_t)bswap_64(x) )
+/* Dynamic array functions, specialized for one class and one byte order */
+typedef struct
+{
+    size_t entsize;
+    void (*decode)(const char *data, size_t count, Elf_Dynamic *entries);
+    void (*set_tag)(char *data, size_t index, int64_t tag);
+} Elf_Walker;
 
-#define HDRWS(o, x) (is_e32() ? DO_SWAPS32(o.e32.x) : DO_SWAPS64(o.e64.x))
-#define HDRHS(o, x) (is_e32() ? DO_SWAPS16(o.e32.x) : DO_SWAPS16(o.e64.x))
-#define HDRWU(o, x) (is_e32() ? DO_SWAPU32(o.e32.x) : DO_SWAPU64(o.e64.x))
-#define HDRHU(o, x) (is_e32() ? DO_SWAPU16(o.e32.x) : DO_SWAPU16(o.e64.x))
+/* Everything known about an opened ELF file */
+typedef struct
+{
+    Elf_Header ehdr;
+    const Elf_Walker *walker;
+    FILE *err;
+    char *map;
+    size_t size;
+    int fd;
+    int e32;
+    int swap;
+} Elf_File;
 
-#define PHDR(x)   (is_e32() ? DO_SWAPU32(phdr.e32.x) : DO_SWAPU64(phdr.e64.x))
-#define SHDR_W(x) (is_e32() ? DO_SWAPU32(shdr.e32.x) : DO_SWAPU32(shdr.e64.x))
-#define SHDR_O(x) (is_e32() ? DO_SWAPU32(shdr.e32.x) : DO_SWAPU64(shdr.e64.x))
+#define DO_SWAPU16(f, x) ( !(f)->swap ? x : (uint16_t)bswap_16(x) )
+#define DO_SWAPU32(f, x) ( !(f)->swap ? x : (uint32_t)bswap_32(x) )
+#define DO_SWAPU64(f, x) ( !(f)->swap ? x : (uint64_t)bswap_64(x) )
+#define DO_SWAPS16(f, x) ( !(f)->swap ? x : (int16_t)bswap_16(x) )
+#define DO_SWAPS32(f, x) ( !(f)->swap ? x : (int32_t)bswap_32(x) )
+#define DO_SWAPS64(f, x) ( !(f)->swap ? x : (int64_t)bswap_64(x) )
 
-#define SWAPU(x)  (is_e32() ? ( !swap_bytes() ? (*((uint32_t*)x)) : (uint32_t)bswap_32(*((uint32_t*)x))) : ( !swap_bytes() ? (*((uint64_t*)x)) : (uint64_t)bswap_64(*((uint64_t*)x))))
-#define SWAPS(x)  (is_e32() ? ( !swap_bytes() ? (*((int32_t*)x)) : (int32_t)bswap_32(*((int32_t*)x))) : ( !swap_bytes() ? (*((int64_t*)x)) : (int64_t)bswap_64(*((int64_t*)x))))
-#define ADV(i, x) (is_e32() ? (i += (sizeof(int32_t) * x)) : (i += (sizeof(int64_t) * x)))
+#define HDRWS(f, o, x) ((f)->e32 ? DO_SWAPS32(f, (o).e32.x) : DO_SWAPS64(f, (o).e64.x))
+#define HDRHS(f, o, x) ((f)->e32 ? DO_SWAPS16(f, (o).e32.x) : DO_SWAPS16(f, (o).e64.x))
+#define HDRWU(f, o, x) ((f)->e32 ? DO_SWAPU32(f, (o).e32.x) : DO_SWAPU64(f, (o).e64.x))
+#define HDRHU(f, o, x) ((f)->e32 ? DO_SWAPU16(f, (o).e32.x) : DO_SWAPU16(f, (o).e64.x))
 
-int elf_open(const char *filename, int flags, Elf_Header *ehdr);
-int elf_find_program(int fd, uint32_t type, const Elf_Header *ehdr, Elf_Program *phdr);
-int elf_find_section(int fd, uint32_t type, const Elf_Header *ehdr, Elf_Section *shdr);
-void elf_close(int fd);
+int elf_open(Elf_File *elf, const char *filename, int flags, FILE *err);
+int elf_find_program(const Elf_File *elf, uint32_t type, Elf_Program *phdr);
+int elf_find_address(const Elf_File *elf, uint64_t address, uint64_t length, size_t *offset);
+int elf_find_section(const Elf_File *elf, uint32_t type, Elf_Section *shdr);
+char* elf_data(const Elf_File *elf, size_t offset, size_t length);
+void elf_data_free(const Elf_File *elf, char *data);
+Elf_Dynamic* elf_dynamic(const Elf_File *elf, const char *data, size_t length, size_t *count);
+void elf_dynamic_set_tag(const Elf_File *elf, char *data, size_t index, int64_t tag);
+void elf_close(Elf_File *elf);
 
 #endif
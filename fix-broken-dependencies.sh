@@ -24,57 +24,26 @@ case $1 in
 		;;
 esac
 
-control() {
-	# Hash table to store replacements of libraries
-	declare -A libs
-	local f
-	local l
-
-	list() {
-		local l
-		while read l; do
-			# Add the file name to a list to keep track on what program has missing deps
-			echo "$1" >> /tmp/broken-deps
-
-			# Check if the library has already been processed
-			if [[ ! " ${!libs[@]} " =~ " $l " ]]; then
-				libs["$l"]=$(dyngler --query-replace "$l" || echo "NOT FOUND! ($1)")
-			fi
-		done < <(dyngler --query-missing "$1")
-	}
-
-	# Clear the temporary program list
-	> /tmp/broken-deps
+# The plan lists the missing libraries of the programs, each resolved once, and the programs to fix
+plan=/tmp/broken-deps
 
-	# Start by listing all the missing libraries
-	while read f; do
-		list "$f"
-	done > /dev/null 2>&1 < <(find /usr/local/bin -executable -type f ! -name '*.la')
-
-	# Print the summary report of replacements
+control() {
+	# Scan the programs once, and print the summary report of replacements
 	printf 'REPORT:\n\n'
-	for l in "${!libs[@]}"; do
-		echo "$l => ${libs[$l]}"
-	done
+	dyngler --repair-plan "$plan" -R /usr/local/bin 2> /dev/null
 }
 
 process() {
-	local f
-
-	# Check if the temporary program list exists
-	if [ -f /tmp/broken-deps ]; then
-		# Repair each file
-		while IFS="" read -r f; do
-			dyngler --repair-deps "$f"
-		done < /tmp/broken-deps
+	# Check if the plan exists
+	if [ -f "$plan" ]; then
+		# Apply it as it was reviewed, without resolving again
+		dyngler --repair-apply "$plan"
 
-		# Remove the temporary list
-		rm -f /tmp/broken-deps
+		# Remove the plan
+		rm -f "$plan"
 	else
-		# Repair every executable we find
-		while read f; do
-			dyngler --repair-deps "$f"
-		done < <(find /usr/local/bin -executable -type f ! -name '*.la')
+		# Repair every program we find
+		dyngler --repair-deps -R /usr/local/bin
 	fi
 }
 
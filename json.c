@@ -0,0 +1,125 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Build JSON lines in memory, to write each of them at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "json.h"
+
+static void append(Json_Buffer *buffer, const char *data, size_t length)
+{
+    char *grown;
+
+    if (buffer->failed)
+        return;
+
+    /* Grow by powers of two */
+    if (buffer->length + length > buffer->capacity)
+    {
+        size_t newCapacity = buffer->capacity == 0 ? 1024 : buffer->capacity * 2;
+        while (buffer->length + length > newCapacity)
+            newCapacity *= 2;
+        if ((grown = realloc(buffer->data, newCapacity)) == NULL)
+        {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->data = grown;
+        buffer->capacity = newCapacity;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+void json_raw(Json_Buffer *buffer, const char *str)
+{
+    append(buffer, str, strlen(str));
+}
+
+void json_string(Json_Buffer *buffer, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run;
+    char escape[7];
+
+    if (str == NULL)
+    {
+        json_raw(buffer, "null");
+        return;
+    }
+
+    append(buffer, "\"", 1);
+    while (*str)
+    {
+        /* Copy the characters which don't need to be escaped at once */
+        for (run = str; *str && *str != '"' && *str != '\\' && (unsigned char)*str >= 0x20; str++)
+            continue;
+        append(buffer, run, str - run);
+
+        if (*str == '\0')
+            break;
+
+        if (*str == '"' || *str == '\\')
+        {
+            escape[0] = '\\';
+            escape[1] = *str;
+            append(buffer, escape, 2);
+        }
+        else
+        {
+            memcpy(escape, "\\u00", 4);
+            escape[4] = hex[(unsigned char)*str >> 4];
+            escape[5] = hex[*str & 0xf];
+            append(buffer, escape, 6);
+        }
+        str++;
+    }
+    append(buffer, "\"", 1);
+}
+
+void json_append(Json_Buffer *buffer, const Json_Buffer *other)
+{
+    append(buffer, other->data, other->length);
+    buffer->failed |= other->failed;
+}
+
+void json_key(Json_Buffer *buffer, const char *key)
+{
+    /* Every key but the first of an object is preceded by a comma */
+    if (buffer->length > 0 && buffer->data[buffer->length - 1] != '{')
+        append(buffer, ",", 1);
+    json_string(buffer, key);
+    append(buffer, ":", 1);
+}
+
+int json_flush(Json_Buffer *buffer, FILE *out, FILE *err)
+{
+    int rv = 1;
+
+    append(buffer, "\n", 1);
+
+    /* The whole line is written at once */
+    if (buffer->failed)
+    {
+        fprintf(err, "Failed to allocate memory for the JSON output: %s!\n", strerror(ENOMEM));
+        rv = 0;
+    }
+    else if (fwrite(buffer->data, 1, buffer->length, out) != buffer->length)
+    {
+        fprintf(err, "Failed to write the JSON output: %s!\n", strerror(errno));
+        rv = 0;
+    }
+
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = buffer->capacity = 0;
+    buffer->failed = 0;
+
+    return rv;
+}
@@ -0,0 +1,28 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Build JSON lines in memory, to write each of them at once.
+ */
+
+#ifndef JSON_H_INCLUDED
+#define JSON_H_INCLUDED
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+} Json_Buffer;
+
+void json_raw(Json_Buffer *buffer, const char *str);
+void json_string(Json_Buffer *buffer, const char *str);
+void json_append(Json_Buffer *buffer, const Json_Buffer *other);
+void json_key(Json_Buffer *buffer, const char *key);
+int json_flush(Json_Buffer *buffer, FILE *out, FILE *err);
+
+#endif
@@ -11,9 +11,13 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
 #include "ldcache.h"
+#include "stats.h"
+#include "probes.h"
 
 #define CACHE_MAGIC "glibc-ld.so.cache1.1"
 #define FLAG_ELF 0x01
@@ -34,49 +38,153 @@ typedef struct
     uint64_t hwcap;
 } Entry;
 
-static off_t align(int fd, size_t alignment)
+static uint32_t hash(const char *str, size_t len)
 {
-    const off_t pos = lseek(fd, 0, SEEK_CUR);
-    const size_t align = (size_t)pos % alignment;
+    uint32_t h = 2166136261u;
 
-    /* If already aligned, do nothing */
-    if (align == 0)
-        return pos;
-
-    /* Else, align the position by advancing */
-    return lseek(fd, alignment - align, SEEK_CUR);
+    /* FNV-1a */
+    while (len-- > 0)
+    {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    return h;
 }
 
-static size_t length(int fd)
+static size_t base(const char *str)
 {
-    const off_t pos = lseek(fd, 0, SEEK_CUR);
-    char c;
-    size_t n = 0;
+    size_t i = 0;
+    const size_t len = strlen(str);
 
-    while (read(fd, &c, sizeof(char)) == sizeof(char))
+    /* Extract the "main" part ot the library name */
+    for (; i < len; i++)
     {
-        if (c == '\0' || n > PATH_MAX)
+        if (str[i] == '.')
             break;
+    }
+    return i;
+}
 
+static uint32_t version(const char *str, uint32_t *components)
+{
+    uint32_t n = 0;
+
+    /* The version components follow the ".so." part of the name */
+    if ((str = strstr(str, ".so.")) == NULL)
+        return 0;
+    str += 3;
+
+    while (n < LD_VERSIONS && str[0] == '.' && str[1] >= '0' && str[1] <= '9')
+    {
+        components[n] = strtoul(str + 1, (char**)&str, 10);
         n++;
     }
-
-    lseek(fd, pos, SEEK_SET);
     return n;
 }
 
-static size_t base(const char *str)
+static size_t find_base(const LD_Cache *cache, const char *name, size_t baselen)
 {
-    size_t i = 0;
-    const size_t len = strlen(str);
+    size_t slot = hash(name, baselen) & cache->indexmask;
+    uint32_t i;
 
-    /* Extract the "main" part ot the library name */
-    for (; i < len; i++)
+    /* Probe until the group of the base, or an empty slot */
+    while ((i = cache->bases[slot]) != 0)
     {
-        if (str[i] == '.')
+        const LD_Entry *entry = &cache->entries[i - 1];
+        if (entry->baselen == baselen && strncmp(entry->name, name, baselen) == 0)
             break;
+        slot = (slot + 1) & cache->indexmask;
     }
-    return i;
+    return slot;
+}
+
+static void rank(const uint32_t *components, uint32_t count, const LD_Entry *entry, uint32_t *key)
+{
+    uint32_t i = 0;
+
+    /* Count the components in common with the wanted version */
+    while (i < count && i < entry->versions && entry->version[i] == components[i])
+        i++;
+    key[0] = i;
+
+    /* Then rank how the first different component compares:
+     * a shorter version (libfoo.so.1 for libfoo.so.1.2) first, then the nearest newer, then the nearest older.
+     * A name without any version comes last.
+     */
+    if (i >= count || i >= entry->versions)
+    {
+        key[1] = i > 0 || count == 0 ? 0 : 3;
+        key[2] = 0;
+    }
+    else if (entry->version[i] > components[i])
+    {
+        key[1] = 1;
+        key[2] = entry->version[i] - components[i];
+    }
+    else
+    {
+        key[1] = 2;
+        key[2] = components[i] - entry->version[i];
+    }
+}
+
+static int closer(const uint32_t *components, uint32_t count, const LD_Entry *a, const LD_Entry *b)
+{
+    uint32_t ka[3], kb[3];
+
+    rank(components, count, a, ka);
+    rank(components, count, b, kb);
+
+    if (ka[0] != kb[0])
+        return ka[0] > kb[0];
+    if (ka[1] != kb[1])
+        return ka[1] < kb[1];
+    return ka[2] < kb[2];
+}
+
+static int build_index(LD_Cache *cache)
+{
+    size_t i, slot, size = 16;
+
+    /* Keep the load factor under one half */
+    while (size < cache->length * 2)
+        size *= 2;
+
+    if ((cache->index = calloc(size, sizeof(uint32_t))) == NULL)
+        return 0;
+    if ((cache->bases = calloc(size, sizeof(uint32_t))) == NULL)
+    {
+        free(cache->index);
+        return 0;
+    }
+    cache->indexmask = size - 1;
+
+    /* The slots store the entry position plus one, zero means empty */
+    for (i = 0; i < cache->length; i++)
+    {
+        slot = hash(cache->entries[i].name, cache->entries[i].length) & cache->indexmask;
+        while (cache->index[slot] != 0)
+        {
+            /* Keep the first entry of a name, as the cache is ordered by priority */
+            if (strcmp(cache->entries[cache->index[slot] - 1].name, cache->entries[i].name) == 0)
+                break;
+            slot = (slot + 1) & cache->indexmask;
+        }
+        if (cache->index[slot] == 0)
+            cache->index[slot] = i + 1;
+    }
+
+    /* Group the entries by base name, going backward so that each group is in cache order */
+    for (i = cache->length; i-- > 0;)
+    {
+        LD_Entry *entry = &cache->entries[i];
+
+        slot = find_base(cache, entry->name, entry->baselen);
+        entry->next = cache->bases[slot];
+        cache->bases[slot] = i + 1;
+    }
+
+    return 1;
 }
 
 static const char* occurence(const char *str, const char *find)
@@ -98,16 +206,19 @@ static const char* occurence(const char *str, const char *find)
     return NULL;
 }
 
-static void rpath_origin(const char *origin, const char *path, char *dest, const size_t len)
+static int rpath_origin(const char *origin, const char *path, char *dest, const size_t len)
 {
     const char *sub = occurence(path, "$ORIGIN");
     size_t fi = 0, si = 0;
 
-    if (sub != NULL)
+    if (sub != NULL && sub < path + len)
     {
         const size_t origlen = sub - path;
         const size_t baselen = strrchr(origin, '/') - origin; /* The origin has to have a '/', since we handled that case in main */
 
+        if (len - 7 + baselen >= PATH_MAX)
+            return 0;
+
         /* Replace the special variable $ORIGIN with the location of the file */
         memcpy(dest, path, origlen); fi += origlen; si += origlen;
         memcpy(dest + fi, origin, baselen); fi += baselen; si += 7;
@@ -115,32 +226,44 @@ static void rpath_origin(const char *origin, const char *path, char *dest, const
     }
     else
     {
+        if (len >= PATH_MAX)
+            return 0;
+
         memcpy(dest, path, len);
         fi += len;
     }
 
     dest[fi] = 0;
+    return 1;
 }
 
-static int search_file_dir(const char *path, const char *name)
+static int search_file_dir(const LD_Cache *cache, const char *path, const char *name)
 {
-    char fullpath[PATH_MAX];
-    strcpy(fullpath, path);
-    strcat(fullpath, "/");
-    strcat(fullpath, name);
-    return access(fullpath, F_OK) == 0;
+    /* The listings of the directories are cached, rather than probing every file */
+    return dircache_contains(cache->dirs, path, name);
+}
+
+static const char* string_at(const LD_Cache *cache, uint32_t offset)
+{
+    const char *str = (const char*)cache->map + offset;
+
+    /* The string has to be terminated inside the cache */
+    if (offset >= cache->size || memchr(str, '\0', cache->size - offset) == NULL)
+        return NULL;
+
+    return str;
 }
 
 LD_Cache* ldcache_parse(const char *filename)
 {
     LD_Cache *cache = NULL;
-    Header header;
-    Entry entry;
-    char magic[sizeof(CACHE_MAGIC) - 1], path[PATH_MAX];
-    off_t strPos, curPos;
+    const Header *header;
+    const Entry *entry;
+    struct stat stats;
+    void *map;
     uint32_t i;
-    size_t n, l;
-    int fd = -1;
+    size_t n;
+    int fd;
 
     /* Open the cache */
     if ((fd = open(filename, O_RDONLY)) == -1)
@@ -148,27 +271,43 @@ LD_Cache* ldcache_parse(const char *filename)
         fprintf(stderr, "Failed to open cache file: %s!\n", strerror(errno));
         return NULL;
     }
+    STATS_COUNT(SC_OPEN, 1);
+    STATS_COUNT(SC_STAT, 1);
 
-    /* Check the magic number */
-    if (read(fd, magic, sizeof(CACHE_MAGIC) - 1) != sizeof(CACHE_MAGIC) - 1)
+    if (fstat(fd, &stats) != 0)
     {
-        fprintf(stderr, "Failed to read the cache's magic number: %s!\n", strerror(errno));
-        goto RET;
+        fprintf(stderr, "Failed to read the stats of the cache file: %s!\n", strerror(errno));
+        close(fd);
+        return NULL;
     }
-    if (strncmp(magic, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1) != 0)
+    if ((size_t)stats.st_size < sizeof(Header))
     {
-        fprintf(stderr, "The cache's magic number doesn't compute: %s!\n", strerror(errno));
-        goto RET;
+        fputs("Failed to read the cache's header: the file is too short!\n", stderr);
+        close(fd);
+        return NULL;
     }
 
-    /* Rewind to the beginning of the file */
-    lseek(fd, 0, SEEK_SET);
+    /* Map the whole cache, the entries will point right into it */
+    map = mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map the cache file: %s!\n", strerror(errno));
+        return NULL;
+    }
+    STATS_COUNT(SC_MAP, 1);
+    STATS_COUNT(SC_BYTES_MAPPED, stats.st_size);
 
-    /* Read the header */
-    strPos = align(fd, __alignof__(Header));
-    if (read(fd, &header, sizeof(Header)) != sizeof(Header))
+    /* Check the magic number */
+    header = map;
+    if (strncmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1) != 0)
     {
-        fprintf(stderr, "Failed to read the cache's header: %s!\n", strerror(errno));
+        fputs("The cache's magic number doesn't compute!\n", stderr);
+        goto RET;
+    }
+    if (header->lib_count > (stats.st_size - sizeof(Header)) / sizeof(Entry))
+    {
+        fputs("The cache's entries lie outside of the file!\n", stderr);
         goto RET;
     }
 
@@ -178,115 +317,120 @@ LD_Cache* ldcache_parse(const char *filename)
         fprintf(stderr, "Failed to allocate memory for the cache: %s!\n", strerror(errno));
         goto RET;
     }
+    cache->map = map;
+    cache->size = stats.st_size;
     cache->paths = NULL;
+    cache->pathlen = 0;
+
+    /* The directories listings are filled as they are searched */
+    if ((cache->dirs = dircache_create()) == NULL)
+        fprintf(stderr, "Failed to allocate memory for the directories listings: %s!\n", strerror(errno));
 
     /* Allocate the cache's entries */
-    if ((cache->entries = malloc(sizeof(LD_Entry) * header.lib_count)) == NULL)
+    if ((cache->entries = malloc(sizeof(LD_Entry) * (header->lib_count > 0 ? header->lib_count : 1))) == NULL)
     {
         fprintf(stderr, "Failed to allocate memory for the cache's entries: %s!\n", strerror(errno));
+        if (cache->dirs != NULL)
+            dircache_free(cache->dirs);
         free(cache);
+        cache = NULL;
         goto RET;
     }
 
-    /* Read the entries */
-    for (i = 0, n = 0; i < header.lib_count; i++)
+    /* Reference the entries, which follow the header */
+    entry = (const Entry*)(header + 1);
+    for (i = 0, n = 0; i < header->lib_count; i++, entry++)
     {
-        const size_t rd = read(fd, &entry, sizeof(Entry));
-        if (rd != sizeof(Entry))
-        {
-            fprintf(stderr, "Failed to read the cache's entry: %s!\n", strerror(errno));
+        if (!(entry->flags & FLAG_ELF))
             continue;
-        }
 
-        if (!(entry.flags & FLAG_ELF))
-            continue;
-
-        /* Memorize the current offset */
-        curPos = lseek(fd, 0, SEEK_CUR);
-
-        /* Move to the key string offset */
-        lseek(fd, strPos + entry.key, SEEK_SET);
-
-        /* Read the key string */
-        l = length(fd);
-        if (read(fd, cache->entries[n].name, l) != l)
+        /* The strings offsets are relative to the beginning of the cache */
+        if ((cache->entries[n].name = string_at(cache, entry->key)) == NULL)
         {
-            fprintf(stderr, "Failed to read the entry name: %s!\n", strerror(errno));
+            fputs("Failed to read the entry name!\n", stderr);
             continue;
         }
-
-        /* Move to the value string offset */
-        lseek(fd, strPos + entry.value, SEEK_SET);
-
-        /* Read the value string.
-         * Storing it in the cache is useless since we only care about the library name.
-         */
-        l = length(fd);
-        if (read(fd, path, l) != l)
+        if ((cache->entries[n].path = string_at(cache, entry->value)) == NULL)
         {
-            fprintf(stderr, "Failed to read the entry value: %s!\n", strerror(errno));
+            fputs("Failed to read the entry value!\n", stderr);
             continue;
         }
 
-        /* Return to the saved offset */
-        lseek(fd, curPos, SEEK_SET);
+        /* Parse the name up front, for the replacements */
+        cache->entries[n].length = strlen(cache->entries[n].name);
+        cache->entries[n].baselen = base(cache->entries[n].name);
+        cache->entries[n].versions = version(cache->entries[n].name, cache->entries[n].version);
+
         n++;
     }
 
     /* Set the cache's length */
     cache->length = n;
 
+    /* Index the names */
+    if (!build_index(cache))
+    {
+        fprintf(stderr, "Failed to allocate memory for the cache's index: %s!\n", strerror(errno));
+        if (cache->dirs != NULL)
+            dircache_free(cache->dirs);
+        free(cache->entries);
+        free(cache);
+        cache = NULL;
+        goto RET;
+    }
+
   RET:
-    /* Close the cache */
-    close(fd);
+    if (cache == NULL)
+        munmap(map, stats.st_size);
 
     return cache;
 }
 
-const char* ldcache_replacement(const LD_Cache *cache, const char *name)
+const char* ldcache_replacement(const LD_Cache *cache, const char *name, size_t available)
 {
-    size_t i;
+    const LD_Entry *best = NULL;
+    uint32_t components[LD_VERSIONS], count, i;
 
-    /* Extract the "main" part ot the name */
+    /* Extract the "main" part and the version of the name */
     const size_t s = base(name);
+    count = version(name, components);
 
-    /* Search for a name in the cache, that is the close to the original */
-    for (i = 0; i < cache->length; i++)
+    /* Search the group of the name, for the closest version being slim enough */
+    for (i = cache->bases[find_base(cache, name, s)]; i != 0; i = cache->entries[i - 1].next)
     {
-        const char *cacheName = cache->entries[i].name;
-        if (s != base(cacheName))
-            continue;
-        if (strncmp(cacheName, name, s) != 0)
+        const LD_Entry *entry = &cache->entries[i - 1];
+        if (entry->length > available)
             continue;
-        if (strcmp(cacheName, name) == 0)
+        if (strcmp(entry->name, name) == 0)
             continue;
-        return cacheName;
+        if (best == NULL || closer(components, count, entry, best))
+            best = entry;
     }
 
     /* No replacement have been found */
-    return NULL;
+    return best != NULL ? best->name : NULL;
 }
 
-int ldcache_search(const LD_Cache *cache, const char *name)
+static LD_Source search_source(const LD_Cache *cache, const char *name)
 {
     size_t i;
 
     /* Firstly, search for the library file in the system directories */
 #if defined(SYSTEM_LIBS_3)
-    if (search_file_dir(SYSTEM_LIBS_1, name))
-        return 1;
-    if (search_file_dir(SYSTEM_LIBS_2, name))
-        return 1;
-    if (search_file_dir(SYSTEM_LIBS_3, name))
-        return 1;
+    if (search_file_dir(cache, SYSTEM_LIBS_1, name))
+        return LD_SYSTEM;
+    if (search_file_dir(cache, SYSTEM_LIBS_2, name))
+        return LD_SYSTEM;
+    if (search_file_dir(cache, SYSTEM_LIBS_3, name))
+        return LD_SYSTEM;
 #elif defined(SYSTEM_LIBS_2)
-    if (search_file_dir(SYSTEM_LIBS_1, name))
-        return 1;
-    if (search_file_dir(SYSTEM_LIBS_2, name))
-        return 1;
+    if (search_file_dir(cache, SYSTEM_LIBS_1, name))
+        return LD_SYSTEM;
+    if (search_file_dir(cache, SYSTEM_LIBS_2, name))
+        return LD_SYSTEM;
 #elif defined(SYSTEM_LIBS_1)
-    if (search_file_dir(SYSTEM_LIBS_1, name))
-        return 1;
+    if (search_file_dir(cache, SYSTEM_LIBS_1, name))
+        return LD_SYSTEM;
 #endif
 
     /* Then, search it in the saved paths */
@@ -294,68 +438,96 @@ int ldcache_search(const LD_Cache *cache, const char *name)
     {
         for (i = 0; i < cache->pathlen; i++)
         {
-            if (search_file_dir(cache->paths[i].path, name))
-                return 1;
+            if (search_file_dir(cache, cache->paths[i].path, name))
+                return LD_PATH;
         }
     }
 
-    /* Finally, search for the name in the cache.
-     *
-     * Note: Binary search would have been more efficient.
-     * However, I didn't find the guarantee that the ldcache would always be sorted...
-     *
-     * So it's a classic linear search.
-     */
-    for (i = 0; i < cache->length; i++)
+    /* Finally, search for the name in the cache */
+    return ldcache_find(cache, name) != NULL ? LD_CACHE : LD_NOWHERE;
+}
+
+int ldcache_search(const LD_Cache *cache, const char *name)
+{
+    const LD_Source source = search_source(cache, name);
+
+    PROBE2(dyngler, resolve, name, source);
+    return source != LD_NOWHERE;
+}
+
+const LD_Entry* ldcache_find(const LD_Cache *cache, const char *name)
+{
+    size_t slot = hash(name, strlen(name)) & cache->indexmask;
+    uint32_t i;
+
+    /* Probe the index until an empty slot */
+    while ((i = cache->index[slot]) != 0)
     {
-        if (strcmp(cache->entries[i].name, name) == 0)
-            return 1;
+        if (strcmp(cache->entries[i - 1].name, name) == 0)
+            return &cache->entries[i - 1];
+        slot = (slot + 1) & cache->indexmask;
     }
 
-    /* Return zero if nothing was found */
-    return 0;
+    return NULL;
 }
 
-int ldcache_setpath(LD_Cache *cache, const char *path, const char *filename)
+LD_Path* ldcache_splitpath(const char *path, const char *filename, size_t *count)
 {
-    size_t i, j, count = 1;
+    LD_Path *paths;
+    size_t i, start = 0, n = 1;
     const size_t len = strlen(path);
 
     /* Count the number of entries in the path (separated by colons) */
     for (i = 0; i < len; i++)
     {
         if (path[i] == ':')
-            count++;
+            n++;
     }
 
-    /* Allocate the paths, assuming the path is not already allocated! */
-    if ((cache->paths = malloc(sizeof(LD_Path) * count)) == NULL)
+    /* Allocate the paths */
+    if ((paths = malloc(sizeof(LD_Path) * n)) == NULL)
     {
         fprintf(stderr, "Failed to allocate memory for the paths: %s!\n", strerror(errno));
-        return 0;
+        return NULL;
     }
 
-    /* Set the cache's number of paths */
-    cache->pathlen = count;
-
-    /* Process the paths */
-    count = j = 0;
-    for (i = 0; i < len; i++)
+    /* Process the paths, skipping the ones too long to be a path */
+    *count = 0;
+    for (i = 0; i <= len; i++)
     {
-        if (path[i] == ':')
+        if (i == len || path[i] == ':')
         {
-            rpath_origin(filename, path + count, cache->paths[j++].path, i);
-            count = ++i;
+            if (rpath_origin(filename, path + start, paths[*count].path, i - start))
+                (*count)++;
+            start = i + 1;
         }
     }
 
-    rpath_origin(filename, path + count, cache->paths[j++].path, i);
+    return paths;
+}
 
-    return 1;
+int ldcache_setpath(LD_Cache *cache, const char *path, const char *filename)
+{
+    /* Release the paths of a previously processed file */
+    ldcache_clearpath(cache);
+
+    return (cache->paths = ldcache_splitpath(path, filename, &cache->pathlen)) != NULL;
+}
+
+void ldcache_clearpath(LD_Cache *cache)
+{
+    free(cache->paths);
+    cache->paths = NULL;
+    cache->pathlen = 0;
 }
 
 void ldcache_free(LD_Cache *cache)
 {
+    munmap(cache->map, cache->size);
+    if (cache->dirs != NULL)
+        dircache_free(cache->dirs);
+    free(cache->bases);
+    free(cache->index);
     free(cache->entries);
     free(cache->paths);
     free(cache);
@@ -8,31 +8,67 @@
 #ifndef LDCACHE_H_INCLUDED
 #define LDCACHE_H_INCLUDED
 
+#include <stddef.h>
+#include <stdint.h>
 #include <linux/limits.h>
+#include "dircache.h"
 
 typedef struct
 {
     char path[PATH_MAX];
 } LD_Path;
 
+/* Location of the cache written by ldconfig */
+#define LD_CACHE_PATH "/etc/ld.so.cache"
+
+/* Number of so-version components parsed from a library name */
+#define LD_VERSIONS 4
+
+/* Pass as the available length when it doesn't matter */
+#define LD_ANY_LENGTH ((size_t)-1)
+
+/* Where a library was found, as passed to the resolve probe */
+typedef enum
+{
+    LD_NOWHERE,
+    LD_SYSTEM, /* In a system directory */
+    LD_PATH,   /* In a directory of the run-time path */
+    LD_CACHE   /* In the cache itself */
+} LD_Source;
+
+/* The strings point inside the mapped cache */
 typedef struct
 {
-    char name[NAME_MAX];
-    /*char path[PATH_MAX];*/
+    const char *name;
+    const char *path;
+    size_t length;
+    size_t baselen;
+    uint32_t version[LD_VERSIONS];
+    uint32_t versions;
+    uint32_t next;
 } LD_Entry;
 
 typedef struct
 {
+    void *map;
+    size_t size;
     LD_Entry *entries;
+    uint32_t *index;
+    uint32_t *bases;
+    size_t indexmask;
+    Dir_Cache *dirs;
     LD_Path *paths;
     size_t length;
     size_t pathlen;
 } LD_Cache;
 
 LD_Cache* ldcache_parse(const char *filename);
-const char* ldcache_replacement(const LD_Cache *cache, const char *name);
+const char* ldcache_replacement(const LD_Cache *cache, const char *name, size_t available);
 int ldcache_search(const LD_Cache *cache, const char *name);
+const LD_Entry* ldcache_find(const LD_Cache *cache, const char *name);
+LD_Path* ldcache_splitpath(const char *path, const char *filename, size_t *count);
 int ldcache_setpath(LD_Cache *cache, const char *path, const char *filename);
+void ldcache_clearpath(LD_Cache *cache);
 void ldcache_free(LD_Cache *cache);
 
 #endif
@@ -9,16 +9,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include "dynamic.h"
+#include "batch.h"
+#include "closure.h"
+#include "daemon.h"
+#include "stats.h"
+#include "walk.h"
+#include "repair.h"
+#include "patch.h"
 
 static void usage(char *progname)
 {
-    printf("Usage: %s [<options>] <elf-file>\n\n\
+    printf("Usage: %s [<options>] <elf-file> [<elf-file>...]\n\n\
 Options:\n\
   -s,--soname         : Replace (or remove) the soname\n\
   -r,--rpath          : Replace (or remove) the run-time path\n\
   -n,--replace        : Replace needed dependency by one another (supports multiple)\n\
      --repair-deps    : Perform repair on dependencies (don't run on system packages)\n\
+     --repair-plan    : Write the plan of the repair: the missing libraries of all the files, each resolved once\n\
+     --repair-apply   : Apply the replacements of a repair plan to its files, without resolving anything\n\
+     --write-plan     : Leave the files as they are, write the patches of the modifications to a plan instead\n\
+     --apply-plan     : Apply the patches of a plan, checking the files are still those planned ('-' for stdin)\n\
+     --rollback-plan  : Undo the patches of a plan applied before ('-' for stdin)\n\
      --priority-low   : Change the run-time path priority: system libs are above\n\
      --priority-high  : Change the run-time path priority: system libs are below \n\
   -d,--query-depends  : Query the dependencies needed (non-recursive)\n\
@@ -26,27 +39,150 @@ Options:\n\
      --query-soname   : Query the soname\n\
      --query-rpath    : Query the run-time path\n\
      --query-replace  : Query a potential replacement for a specified library name\n\
+     --query-closure  : Query the dependencies recursively, in the order they are loaded\n\
+     --query-dependents : Query the indexed files needing a library, the files given are indexed first\n\
+     --format         : Format of the queries output: text (default), or ndjson for one JSON object per file\n\
   -o,--output         : Output file\n\
+  -a,--atomic         : Patch a copy of the file, then rename it over the file\n\
+  -i,--index          : Keep the dynamic strings of the queried files in an index, to parse only the changed ones\n\
+     --daemon         : Serve the queries on a socket, keeping the cache and the directories in memory\n\
+     --connect        : Send the queries to the daemon serving the socket, if there is one\n\
+     --stats          : Report the time of each phase, the system calls and the bytes moved, per file and overall\n\
+  -@,--list           : Read the files to process from a list, one per line ('-' for stdin)\n\
+  -R,--recursive      : Process the ELF files found in a directory tree (supports multiple)\n\
+     --follow-links   : Follow the symbolic links found in the trees, instead of skipping them\n\
+     --one-filesystem : Don't descend into the directories of other filesystems\n\
+  -j,--jobs           : Number of workers when processing multiple files\n\
   -h,--help           : Show help usage\n\n\
 In order to replace needed dependency, supply two names:\n Example:\n\
   -n <old-name> <new-name>\n\
  Example with multiple replacements:\n\
   -n <old-1> <new-1> -n <old-2> <new-2> [-n <...> <...>]\n\n\
-In order to remove soname or run-time path, don't supply a name after the parameter.\n", progname);
+In order to remove soname or run-time path, don't supply a name after the parameter.\n\n\
+In order to repair many files, plan the repair, review the plan ('-' for stdout), then apply it:\n\
+  --repair-plan <plan> -R <directory>\n\
+  --repair-apply <plan>\n\n\
+When multiple files are supplied, the cache is read once and the files are processed in parallel.\n\
+The output is grouped per file, in the order the files were supplied.\n", progname);
+}
+
+static int add_file(char ***files, size_t *count, size_t *capacity, const char *filename)
+{
+    char **grown, *copy;
+
+    /* Grow the list of files */
+    if (*count == *capacity)
+    {
+        const size_t newCapacity = *capacity == 0 ? 16 : *capacity * 2;
+        if ((grown = realloc(*files, sizeof(char*) * newCapacity)) == NULL)
+        {
+            fprintf(stderr, "Failed to allocate memory for the files: %s!\n", strerror(errno));
+            return 0;
+        }
+        *files = grown;
+        *capacity = newCapacity;
+    }
+
+    if ((copy = malloc(strlen(filename) + 1)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the filename: %s!\n", strerror(errno));
+        return 0;
+    }
+    strcpy(copy, filename);
+
+    (*files)[(*count)++] = copy;
+    return 1;
+}
+
+static int make_safe(char **filename)
+{
+    char *safe;
+
+    /* Handle the case in which the filename is relative and doesn't contains slash */
+    if (strchr(*filename, '/') != NULL)
+        return 1;
+
+    if ((safe = malloc(strlen(*filename) + 3)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the filename: %s!\n", strerror(errno));
+        return 0;
+    }
+
+    /* Prepend "./" as the filename has to contain at least one slash.
+     * Or else the rpath replacement of $ORIGIN won't work.
+     */
+    strcpy(safe, "./");
+    strcat(safe, *filename);
+    free(*filename);
+    *filename = safe;
+
+    return 1;
+}
+
+static int add_list(char ***files, size_t *count, size_t *capacity, const char *listname)
+{
+    FILE *list;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int rv = 1;
+
+    if (strcmp(listname, "-") == 0)
+        list = stdin;
+    else if ((list = fopen(listname, "r")) == NULL)
+    {
+        fprintf(stderr, "Failed to open the list of files: %s!\n", strerror(errno));
+        return 0;
+    }
+
+    /* Every non-empty line is a file */
+    while ((len = getline(&line, &size, list)) != -1)
+    {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (!add_file(files, count, capacity, line))
+        {
+            rv = 0;
+            break;
+        }
+    }
+
+    free(line);
+    if (list != stdin)
+        fclose(list);
+
+    return rv;
 }
 
 int main(int argc, char *const argv[])
 {
-    int i = 1, reps = 0, fix = 0;
+    int i = 1, reps = 0, fix = 0, rollback = 0;
+    long jobs = 0;
     const char *output = NULL;
+    const char *indexname = NULL;
+    const char *daemonSocket = NULL;
+    const char *querySocket = NULL;
     const char *soname = NULL;
     const char *rpath = NULL;
-    const char *filename = NULL;
-    char *filenameSafe = NULL;
+    const char *planname = NULL;
+    const char *patchname = NULL;
+    const char *applyname = NULL;
+    const char *dependents = NULL;
+    char **files = NULL, **dirs = NULL;
+    size_t fileCount = 0, fileCapacity = 0, dirCount = 0, dirCapacity = 0, k;
+    Walk_Options walkOptions = { 0, 0 };
     LD_Cache *ldcache = NULL;
+    Scan_Index *index = NULL;
+    Repair_File *repairs = NULL;
+    FILE *plan = NULL;
     Replacement replacements[REP_MAXIMUM] = {0};
     Priority priority = PRI_UNCHANGED;
     Query query = QU_NOTHING;
+    Write_Mode mode = WR_INPLACE;
+    Format format = FMT_TEXT;
+    Repair_Phase repair = RP_NONE;
 
     /* Checks the arguments */
     while (i < argc)
@@ -58,7 +194,7 @@ int main(int argc, char *const argv[])
             strcmp(arg, "--help") == 0)
         {
             usage(argv[0]);
-            return 0;
+            i = 0; goto RET;
         }
         else if (strcmp(arg, "-s") == 0 ||
                  strcmp(arg, "--soname") == 0)
@@ -86,7 +222,7 @@ int main(int argc, char *const argv[])
             if (i+1 >= argc || argv[i][0] == '-' || argv[i+1][0] == '-')
             {
                 fputs("Missing two names after the parameter!\n", stderr);
-                return 1;
+                i = 1; goto RET;
             }
             replacements[reps].old = argv[i++];
             replacements[reps].new = argv[i++];
@@ -98,91 +234,488 @@ int main(int argc, char *const argv[])
             if (i >= argc || argv[i][0] == '-')
             {
                 fputs("Missing output after parameter!\n", stderr);
-                return 1;
+                i = 1; goto RET;
             }
             else
                 output = argv[i++];
         }
+        else if (strcmp(arg, "-a") == 0 ||
+                 strcmp(arg, "--atomic") == 0)
+            mode = WR_ATOMIC;
+        else if (strcmp(arg, "-i") == 0 ||
+                 strcmp(arg, "--index") == 0)
+        {
+            if (i >= argc || argv[i][0] == '-')
+            {
+                fputs("Missing index after parameter!\n", stderr);
+                i = 1; goto RET;
+            }
+            indexname = argv[i++];
+        }
+        else if (strcmp(arg, "--daemon") == 0 ||
+                 strcmp(arg, "--connect") == 0)
+        {
+            if (i >= argc || argv[i][0] == '-')
+            {
+                fputs("Missing socket after parameter!\n", stderr);
+                i = 1; goto RET;
+            }
+            if (arg[2] == 'd')
+                daemonSocket = argv[i++];
+            else
+                querySocket = argv[i++];
+        }
+        else if (strcmp(arg, "-@") == 0 ||
+                 strcmp(arg, "--list") == 0)
+        {
+            if (i >= argc || (argv[i][0] == '-' && argv[i][1] != '\0'))
+            {
+                fputs("Missing list after parameter!\n", stderr);
+                i = 1; goto RET;
+            }
+            if (!add_list(&files, &fileCount, &fileCapacity, argv[i++]))
+            {
+                i = 3; goto RET;
+            }
+        }
+        else if (strcmp(arg, "-R") == 0 ||
+                 strcmp(arg, "--recursive") == 0)
+        {
+            if (i >= argc || argv[i][0] == '-')
+            {
+                fputs("Missing directory after parameter!\n", stderr);
+                i = 1; goto RET;
+            }
+            if (!add_file(&dirs, &dirCount, &dirCapacity, argv[i++]))
+            {
+                i = 3; goto RET;
+            }
+        }
+        else if (strcmp(arg, "--follow-links") == 0)
+            walkOptions.follow = 1;
+        else if (strcmp(arg, "--one-filesystem") == 0)
+            walkOptions.samefs = 1;
+        else if (strcmp(arg, "-j") == 0 ||
+                 strcmp(arg, "--jobs") == 0)
+        {
+            if (i >= argc || (jobs = strtol(argv[i++], NULL, 10)) <= 0)
+            {
+                fputs("Missing a positive number of workers after parameter!\n", stderr);
+                i = 1; goto RET;
+            }
+        }
+        else if (strcmp(arg, "--format") == 0 ||
+                 strncmp(arg, "--format=", 9) == 0)
+        {
+            const char *name;
+
+            /* The format is either joined to the parameter, or follows it */
+            if (arg[8] == '=')
+                name = arg + 9;
+            else if (i >= argc || argv[i][0] == '-')
+            {
+                fputs("Missing format after parameter!\n", stderr);
+                i = 1; goto RET;
+            }
+            else
+                name = argv[i++];
+
+            if (strcmp(name, "text") == 0)
+                format = FMT_TEXT;
+            else if (strcmp(name, "ndjson") == 0)
+                format = FMT_NDJSON;
+            else
+            {
+                fprintf(stderr, "Unknown format: %s\n", name);
+                i = 1; goto RET;
+            }
+        }
         else if (strcmp(arg, "-d") == 0 ||
                  strcmp(arg, "--query-depends") == 0)
-            query = QU_NEEDED;
+            query |= QU_NEEDED;
         else if (strcmp(arg, "--query-missing") == 0)
-            query = QU_MISSING;
+            query |= QU_MISSING;
         else if (strcmp(arg, "--query-soname") == 0)
-            query = QU_SONAME;
+            query |= QU_SONAME;
         else if (strcmp(arg, "--query-rpath") == 0)
-            query = QU_RPATH;
+            query |= QU_RPATH;
         else if (strcmp(arg, "--query-replace") == 0)
-            query = QU_REPLACEMENT;
+            query |= QU_REPLACEMENT;
+        else if (strcmp(arg, "--query-closure") == 0)
+            query |= QU_CLOSURE;
+        else if (strcmp(arg, "--query-dependents") == 0)
+        {
+            if (i >= argc || argv[i][0] == '-')
+            {
+                fputs("Missing library name after parameter!\n", stderr);
+                i = 1; goto RET;
+            }
+            query |= QU_DEPENDENTS;
+            dependents = argv[i++];
+        }
+        else if (strcmp(arg, "--stats") == 0)
+            stats_enabled = 1;
         else if (strcmp(arg, "--priority-low") == 0)
             priority = PRI_RUNPATH;
         else if (strcmp(arg, "--priority-high") == 0)
             priority = PRI_RPATH;
         else if (strcmp(arg, "--repair-deps") == 0)
             fix = 2;
-        else if (arg[0] == '-')
+        else if (strcmp(arg, "--repair-plan") == 0 ||
+                 strcmp(arg, "--repair-apply") == 0)
         {
-            fprintf(stderr, "Unrecognized parameter: %s\n", arg);
-            return 1;
+            if (i >= argc || (argv[i][0] == '-' && argv[i][1] != '\0'))
+            {
+                fputs("Missing plan after parameter!\n", stderr);
+                i = 1; goto RET;
+            }
+            repair = arg[9] == 'p' ? RP_PLAN : RP_APPLY;
+            planname = argv[i++];
         }
-        else
+        else if (strcmp(arg, "--write-plan") == 0)
         {
-            if (filename != NULL)
+            if (i >= argc || argv[i][0] == '-')
             {
-                fputs("Only one file can be supplied!\n", stderr);
-                return 1;
+                fputs("Missing plan after parameter!\n", stderr);
+                i = 1; goto RET;
             }
-            filename = arg;
+            patchname = argv[i++];
+        }
+        else if (strcmp(arg, "--apply-plan") == 0 ||
+                 strcmp(arg, "--rollback-plan") == 0)
+        {
+            if (i >= argc || (argv[i][0] == '-' && argv[i][1] != '\0'))
+            {
+                fputs("Missing plan after parameter!\n", stderr);
+                i = 1; goto RET;
+            }
+            rollback = arg[2] == 'r';
+            applyname = argv[i++];
+        }
+        else if (arg[0] == '-')
+        {
+            fprintf(stderr, "Unrecognized parameter: %s\n", arg);
+            i = 1; goto RET;
+        }
+        else if (!add_file(&files, &fileCount, &fileCapacity, arg))
+        {
+            i = 3; goto RET;
+        }
+    }
+
+    /* The daemon doesn't process files by itself */
+    if (daemonSocket != NULL)
+    {
+        i = daemon_serve(daemonSocket);
+        goto RET;
+    }
+
+    /* The patches are applied as they are read, without parsing anything */
+    if (applyname != NULL)
+    {
+        if (fileCount > 0 || dirCount > 0 || reps > 0 || soname || rpath || priority != PRI_UNCHANGED || fix != 0 || query != QU_NOTHING
+         || repair != RP_NONE || output != NULL || patchname != NULL || mode != WR_INPLACE)
+        {
+            fputs("The patch plan can't be combined with other files, modifications or queries!\n", stderr);
+            i = 2; goto RET;
+        }
+        i = patch_apply(applyname, rollback, stdout, stderr);
+        if (stats_enabled)
+            stats_report(stderr);
+        goto RET;
+    }
+
+    /* The repair decides the replacements by itself */
+    if (repair != RP_NONE && (reps > 0 || soname || rpath || priority != PRI_UNCHANGED || fix != 0 || query != QU_NOTHING || output != NULL || format != FMT_TEXT))
+    {
+        fputs("The repair plan can't be combined with other modifications or queries!\n", stderr);
+        i = 2; goto RET;
+    }
+
+    /* The dependents are answered from the index, the files given only update it */
+    if (query & QU_DEPENDENTS)
+    {
+        if (query != QU_DEPENDENTS || reps > 0 || soname || rpath || priority != PRI_UNCHANGED || fix != 0 || output != NULL || patchname != NULL)
+        {
+            fputs("The dependents query can't be combined with other modifications or queries!\n", stderr);
+            i = 2; goto RET;
+        }
+        if (indexname == NULL)
+        {
+            fputs("The dependents are found in an index, given with -i!\n", stderr);
+            i = 2; goto RET;
         }
     }
 
-    /* If no files are specified */
-    if (filename == NULL)
+    /* The files to repair are those of the plan */
+    if (repair == RP_APPLY)
     {
+        if (fileCount > 0 || dirCount > 0)
+        {
+            fputs("The files to repair are given by the plan!\n", stderr);
+            i = 2; goto RET;
+        }
+        if ((i = repair_read(planname, &files, &repairs, &fileCount, stderr)) != 0)
+            goto RET;
+        if (fileCount == 0)
+        {
+            fputs("Nothing to repair in the plan.\n", stderr);
+            goto RET;
+        }
+    }
+
+    /* By default, use one worker per processor */
+    if (jobs == 0)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* Add the ELF files of the trees to the files given */
+    for (k = 0; k < dirCount; k++)
+    {
+        char **found = NULL;
+        size_t foundCount = 0, f;
+
+        if ((i = walk_tree(dirs[k], &walkOptions, jobs > 0 ? (unsigned int)jobs : 1, &found, &foundCount)) != 0)
+            goto RET;
+        for (f = 0; f < foundCount; f++)
+        {
+            if (i == 0 && !add_file(&files, &fileCount, &fileCapacity, found[f]))
+                i = 3;
+            free(found[f]);
+        }
+        free(found);
+        if (i != 0)
+            goto RET;
+    }
+
+    /* If no files are specified (the index alone answers the dependents) */
+    if (fileCount == 0 && query != QU_DEPENDENTS)
+    {
+        if (dirCount > 0)
+        {
+            fputs("No ELF file was found in the directories.\n", stderr);
+            i = 0; goto RET;
+        }
         usage(argv[0]);
-        return 2;
+        i = 2; goto RET;
     }
 
     /* Check the input and the output are not the same */
     if (output != NULL)
     {
-        if (strcmp(filename, output) == 0)
+        if (fileCount > 1 || dirCount > 0)
+        {
+            fputs("An output file can't be used with multiple files!\n", stderr);
+            i = 2; goto RET;
+        }
+        if (strcmp(files[0], output) == 0)
         {
             fputs("The input and the output can't be the same!\n", stderr);
-            return 2;
+            i = 2; goto RET;
         }
     }
 
-    /* Handle the case in which the filename is relative and doesn't contains slash */
-    if (strchr(filename, '/') == NULL)
+    /* The patches describe the modifications made in place */
+    if (patchname != NULL)
+    {
+        if (!(reps > 0 || soname || rpath || priority != PRI_UNCHANGED || fix != 0 || repair == RP_APPLY) || query != QU_NOTHING || output != NULL || mode != WR_INPLACE)
+        {
+            fputs("A patch plan can only be written for the modifications made in place!\n", stderr);
+            i = 2; goto RET;
+        }
+        if ((plan = patch_create(patchname, stderr)) == NULL)
+        {
+            i = 4; goto RET;
+        }
+    }
+
+    /* The missing libraries of each file are kept until the plan is written */
+    if (repair == RP_PLAN && (repairs = calloc(fileCount, sizeof(Repair_File))) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the repair plan: %s!\n", strerror(errno));
+        i = 3; goto RET;
+    }
+
+    /* The replacements and the closure don't describe the files, so they can't be combined */
+    if (((query & QU_REPLACEMENT) && query != QU_REPLACEMENT) || ((query & QU_CLOSURE) && query != QU_CLOSURE))
+    {
+        fputs("The replacement and closure queries can't be combined with the others!\n", stderr);
+        i = 2; goto RET;
+    }
+
+    /* The JSON objects answer every query at once, but don't describe the modifications */
+    if (format == FMT_NDJSON)
+    {
+        if (reps > 0 || soname || rpath || priority != PRI_UNCHANGED || fix != 0)
+        {
+            fputs("The NDJSON format can only be used with the queries!\n", stderr);
+            i = 2; goto RET;
+        }
+        if (query == QU_NOTHING)
+            query = QU_NEEDED;
+    }
+
+    /* Library names queried for a replacement are not files */
+    if (query != QU_REPLACEMENT)
     {
-        if ((filenameSafe = malloc(strlen(filename) + 3)) == NULL)
+        for (k = 0; k < fileCount; k++)
         {
-            fprintf(stderr, "Failed to allocate memory for the filename: %s!\n", strerror(errno));
-            return 3;
+            if (!make_safe(&files[k]))
+            {
+                i = 3; goto RET;
+            }
         }
+    }
 
-        /* Prepend "./" as the filename has to contain at least one slash.
-         * Or else the rpath replacement of $ORIGIN won't work.
-         */
-        strcpy(filenameSafe, "./");
-        strcat(filenameSafe, filename);
-        filename = filenameSafe;
+    /* Let the daemon answer, it already has the cache in memory (but then nothing can be measured) */
+    if (querySocket != NULL && !stats_enabled && format == FMT_TEXT && query != QU_NOTHING && query != QU_CLOSURE && query != QU_DEPENDENTS && daemon_available(querySocket))
+    {
+        for (k = 0, i = 0; k < fileCount; k++)
+        {
+            int rv;
+
+            if (fileCount > 1)
+                printf("%s:\n", files[k]);
+            if ((rv = daemon_query(querySocket, files[k], query, stdout, stderr)) == DAEMON_UNREACHABLE)
+            {
+                fputs("Failed to reach the daemon!\n", stderr);
+                rv = 3;
+            }
+            if (rv > i)
+                i = rv;
+        }
+        goto RET;
     }
 
     /* Read the LD cache, to determine whether a library is found or not */
-    if (reps > 0 || query == QU_MISSING || query == QU_REPLACEMENT || fix != 0)
-        ldcache = ldcache_parse("/etc/ld.so.cache");
+    if (reps > 0 || (query & QU_MISSING) || query == QU_REPLACEMENT || query == QU_CLOSURE || (format == FMT_NDJSON && query != QU_DEPENDENTS) || fix != 0 || repair == RP_PLAN)
+    {
+        uint64_t started = 0;
+
+        STATS_START(started);
+        ldcache = ldcache_parse(LD_CACHE_PATH);
+        STATS_LAP(ST_CACHE, started);
+
+        /* Nothing can be planned without it */
+        if (ldcache == NULL && repair == RP_PLAN)
+        {
+            i = 3; goto RET;
+        }
+    }
+
+    /* The index is only useful to the queries, the modifications need the files themselves */
+    if (indexname != NULL && ((query != QU_NOTHING && query != QU_REPLACEMENT) || repair == RP_PLAN))
+    {
+        if ((index = scanindex_open(indexname)) == NULL)
+        {
+            i = 3; goto RET;
+        }
+    }
 
+    /* The work done before the files only counts in the total */
+    if (stats_enabled)
+        stats_end(NULL, NULL);
+
+    /* The files of the trees and of the repair are attributed, even when there is only one */
+    if (fileCount > 1 || dirCount > 0 || repair != RP_NONE || query == QU_DEPENDENTS)
+    {
+        Batch_Options options;
+
+        options.replacements = replacements;
+        options.soname = soname;
+        options.rpath = rpath;
+        options.priority = priority;
+        options.query = query;
+        options.format = format;
+        options.fix = fix;
+        options.mode = mode;
+        options.index = index;
+        options.repair = repair;
+        options.repairs = repairs;
+        options.plan = plan;
+
+        i = batch_run(ldcache, (const char *const*)files, fileCount, jobs > 0 ? (unsigned int)jobs : 1, &options);
+
+        /* Resolve the missing libraries of all the files, each one once */
+        if (repair == RP_PLAN)
+        {
+            const int rv = repair_write(ldcache, (const char *const*)files, repairs, fileCount, planname, stdout, stderr);
+            if (rv > i)
+                i = rv;
+        }
+    }
+    /* The libraries of the closure are parsed once for all */
+    else if (query == QU_CLOSURE)
+    {
+        Closure_Memo *memo;
+
+        if ((memo = closure_create(index)) == NULL)
+        {
+            fprintf(stderr, "Failed to allocate memory for the closure: %s!\n", strerror(errno));
+            i = 3;
+        }
+        else
+        {
+            i = closure_query(ldcache, memo, files[0], format, stdout, stderr);
+            closure_free(memo);
+        }
+    }
     /* If a simple query is selected */
-    if (query != QU_NOTHING)
-        i = dynamics_query(ldcache, filename, query);
+    else if (query != QU_NOTHING)
+        i = dynamics_query(ldcache, index, files[0], query, format, stdout, stderr);
     else
-        i = dynamics_process(ldcache, priority, filename, output, replacements, soname, rpath, fix);
+        i = dynamics_process(ldcache, priority, files[0], output, replacements, soname, rpath, fix, mode, NULL, plan, stdout, stderr);
+
+    if (plan != NULL)
+    {
+        if ((ferror(plan) | fclose(plan)) != 0)
+        {
+            fprintf(stderr, "Failed to write the patch plan: %s!\n", strerror(errno));
+            if (i == 0)
+                i = 4;
+        }
+        plan = NULL;
+    }
+
+    if (stats_enabled && fileCount == 1 && dirCount == 0 && repair == RP_NONE && query != QU_DEPENDENTS)
+        stats_end(files[0], stderr);
+
+    /* The dependents are looked up in the index along with the files just parsed */
+    if (query == QU_DEPENDENTS && index != NULL)
+    {
+        const int rv = scanindex_dependents(index, dependents, format, stdout, stderr);
+        if (rv > i)
+            i = rv;
+    }
+
+    /* Remember the files parsed during this run */
+    if (index != NULL)
+    {
+        if (!scanindex_save(index) && i == 0)
+            i = 4;
+        scanindex_free(index);
+        index = NULL;
+    }
+
+    if (stats_enabled)
+    {
+        stats_end(NULL, NULL);
+        stats_report(stderr);
+    }
 
+  RET:
+    if (index != NULL)
+        scanindex_free(index);
     if (ldcache != NULL)
         ldcache_free(ldcache);
+    if (plan != NULL)
+        fclose(plan);
+    repair_free(repairs, fileCount);
+    for (k = 0; k < fileCount; k++)
+        free(files[k]);
+    free(files);
+    for (k = 0; k < dirCount; k++)
+        free(dirs[k]);
+    free(dirs);
 
-    free(filenameSafe);
     return i;
 }
@@ -0,0 +1,554 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Describe the changes of the files as patches, to apply (or roll back) without parsing them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "patch.h"
+#include "stats.h"
+#include "probes.h"
+
+/* The plan is a text file, its fields are separated by tabs and the lines starting with '#' are comments.
+ * Each file is identified as it was planned, then followed by its patches, the bytes being in hexadecimal:
+ *   file   <device>  <inode>  <size>  <seconds>.<nanoseconds>  <absolute path of the file>
+ *   patch  <offset>  <old bytes>  <new bytes>
+ * The changes never move anything, so the old and new bytes have the same length.
+ */
+#define PATCH_FILE  "file"
+#define PATCH_BYTES "patch"
+
+typedef struct
+{
+    unsigned long offset;
+    size_t length;
+    unsigned char *old; /* The new bytes follow, in the same allocation */
+    unsigned char *new;
+    int done;           /* Already as wanted when checked */
+    int written;        /* Changed by this run, to be undone on failure */
+} Patch;
+
+typedef struct
+{
+    char *filename;
+    unsigned long dev;
+    unsigned long ino;
+    unsigned long size;
+    unsigned long sec;
+    unsigned long nsec;
+    Patch *patches;
+    size_t count;
+    size_t capacity;
+    size_t written;     /* Patches changed by this run */
+} Patch_File;
+
+static void write_hex(FILE *plan, const unsigned char *bytes, size_t length)
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t k;
+
+    for (k = 0; k < length; k++)
+    {
+        putc(digits[bytes[k] >> 4], plan);
+        putc(digits[bytes[k] & 0x0f], plan);
+    }
+}
+
+FILE* patch_create(const char *planname, FILE *err)
+{
+    FILE *plan;
+
+    if ((plan = fopen(planname, "w")) == NULL)
+    {
+        fprintf(err, "Failed to open the patch plan: %s!\n", strerror(errno));
+        return NULL;
+    }
+
+    fputs("# Patch plan of dyngler, to be applied with --apply-plan, or undone with --rollback-plan.\n", plan);
+
+    return plan;
+}
+
+int patch_file(FILE *plan, const char *filename, int fd, FILE *err)
+{
+    struct stat stats;
+    char *path;
+
+    /* The plan may be applied from another directory */
+    if ((path = realpath(filename, NULL)) == NULL)
+    {
+        fprintf(err, "Failed to resolve the path of the file %s: %s!\n", filename, strerror(errno));
+        return 0;
+    }
+    if (strchr(path, '\n') != NULL)
+    {
+        fprintf(err, "The file %s can't be written in the plan!\n", path);
+        free(path);
+        return 0;
+    }
+
+    /* The plan only applies to the file as it is now */
+    if (fstat(fd, &stats) != 0)
+    {
+        fprintf(err, "Failed to read the stats of the input file: %s!\n", strerror(errno));
+        free(path);
+        return 0;
+    }
+
+    fprintf(plan, PATCH_FILE "\t%lu\t%lu\t%lu\t%lu.%09lu\t%s\n", (unsigned long)stats.st_dev, (unsigned long)stats.st_ino,
+            (unsigned long)stats.st_size, (unsigned long)stats.st_mtim.tv_sec, (unsigned long)stats.st_mtim.tv_nsec, path);
+    free(path);
+
+    return 1;
+}
+
+int patch_bytes(FILE *plan, int fd, size_t offset, const char *data, size_t length, FILE *err)
+{
+    unsigned char *old;
+
+    if ((old = malloc(length > 0 ? length : 1)) == NULL)
+    {
+        fprintf(err, "Failed to allocate memory for the patch: %s!\n", strerror(errno));
+        return 0;
+    }
+
+    /* The changes are only in memory, the file still holds the old bytes */
+    STATS_COUNT(SC_READ, 1);
+    STATS_COUNT(SC_BYTES_READ, length);
+    if (pread(fd, old, length, offset) != (ssize_t)length)
+    {
+        fprintf(err, "Failed to read the bytes to patch: %s!\n", strerror(errno));
+        free(old);
+        return 0;
+    }
+
+    fprintf(plan, PATCH_BYTES "\t%lu\t", (unsigned long)offset);
+    write_hex(plan, old, length);
+    putc('\t', plan);
+    write_hex(plan, (const unsigned char*)data, length);
+    putc('\n', plan);
+
+    free(old);
+
+    return 1;
+}
+
+static int read_number(char **cursor, char separator, unsigned long *value)
+{
+    char *end;
+
+    if (**cursor < '0' || **cursor > '9')
+        return 0;
+
+    errno = 0;
+    *value = strtoul(*cursor, &end, 10);
+    if (errno != 0 || *end != separator)
+        return 0;
+
+    *cursor = end + 1;
+    return 1;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int read_hex(const char *hex, size_t length, unsigned char *bytes)
+{
+    size_t k;
+    int high, low;
+
+    for (k = 0; k < length; k++)
+    {
+        if ((high = hex_digit(hex[2 * k])) < 0 || (low = hex_digit(hex[2 * k + 1])) < 0)
+            return 0;
+        bytes[k] = (unsigned char)(high << 4 | low);
+    }
+
+    return 1;
+}
+
+static int read_file(char *line, Patch_File *file)
+{
+    char *cursor = line + strlen(PATCH_FILE) + 1;
+
+    if (!read_number(&cursor, '\t', &file->dev)
+     || !read_number(&cursor, '\t', &file->ino)
+     || !read_number(&cursor, '\t', &file->size)
+     || !read_number(&cursor, '.', &file->sec)
+     || !read_number(&cursor, '\t', &file->nsec)
+     || *cursor == '\0')
+        return 0;
+
+    if ((file->filename = malloc(strlen(cursor) + 1)) == NULL)
+        return -1;
+    strcpy(file->filename, cursor);
+
+    return 1;
+}
+
+static int read_patch(char *line, Patch_File *file)
+{
+    Patch *patch, *grown;
+    char *cursor = line + strlen(PATCH_BYTES) + 1, *old, *new;
+    unsigned long offset;
+    size_t length;
+
+    if (!read_number(&cursor, '\t', &offset) || (new = strchr(cursor, '\t')) == NULL)
+        return 0;
+    old = cursor;
+    length = new++ - old;
+
+    /* Both halves describe the same bytes */
+    if (length % 2 != 0 || strlen(new) != length)
+        return 0;
+    length /= 2;
+
+    if (file->count == file->capacity)
+    {
+        const size_t newCapacity = file->capacity == 0 ? 16 : file->capacity * 2;
+        if ((grown = realloc(file->patches, sizeof(Patch) * newCapacity)) == NULL)
+            return -1;
+        file->patches = grown;
+        file->capacity = newCapacity;
+    }
+
+    patch = &file->patches[file->count];
+    if ((patch->old = malloc(length > 0 ? length * 2 : 1)) == NULL)
+        return -1;
+    patch->new = patch->old + length;
+    patch->offset = offset;
+    patch->length = length;
+    patch->done = 0;
+    patch->written = 0;
+
+    if (!read_hex(old, length, patch->old) || !read_hex(new, length, patch->new))
+    {
+        free(patch->old);
+        return 0;
+    }
+    file->count++;
+
+    return 1;
+}
+
+static void free_file(Patch_File *file)
+{
+    size_t k;
+
+    for (k = 0; k < file->count; k++)
+        free(file->patches[k].old);
+    free(file->patches);
+    free(file->filename);
+    memset(file, 0, sizeof(Patch_File));
+}
+
+/* Check the file is still the one planned, and tell how many of its patches are already there */
+static int check_file(Patch_File *file, int fd, int rollback, size_t *current, FILE *err)
+{
+    struct stat stats;
+    unsigned char *found;
+    size_t k, longest = 0;
+    int changed, rv = 0;
+
+    STATS_COUNT(SC_STAT, 1);
+    if (fstat(fd, &stats) != 0)
+    {
+        fprintf(err, "Failed to read the stats of the file %s: %s!\n", file->filename, strerror(errno));
+        return 3;
+    }
+    if ((unsigned long)stats.st_dev != file->dev || (unsigned long)stats.st_ino != file->ino || (unsigned long)stats.st_size != file->size)
+    {
+        fprintf(err, "The file %s changed since the plan!\n", file->filename);
+        return 3;
+    }
+
+    /* Once applied, the time of the file changed: then only the bytes tell whether it is already patched, or can be rolled back */
+    changed = !rollback && ((unsigned long)stats.st_mtim.tv_sec != file->sec || (unsigned long)stats.st_mtim.tv_nsec != file->nsec);
+
+    for (k = 0; k < file->count; k++)
+    {
+        if (file->patches[k].length > longest)
+            longest = file->patches[k].length;
+    }
+    if ((found = malloc(longest > 0 ? longest : 1)) == NULL)
+    {
+        fprintf(err, "Failed to allocate memory for the patches: %s!\n", strerror(errno));
+        return 3;
+    }
+
+    *current = 0;
+    for (k = 0; k < file->count; k++)
+    {
+        Patch *patch = &file->patches[k];
+        const unsigned char *expected = rollback ? patch->new : patch->old;
+        const unsigned char *wanted = rollback ? patch->old : patch->new;
+
+        STATS_COUNT(SC_READ, 1);
+        STATS_COUNT(SC_BYTES_READ, patch->length);
+        if (pread(fd, found, patch->length, patch->offset) != (ssize_t)patch->length)
+        {
+            fprintf(err, "Failed to read the bytes of %s: %s!\n", file->filename, strerror(errno));
+            rv = 3; goto RET;
+        }
+        if ((patch->done = memcmp(found, wanted, patch->length) == 0))
+            (*current)++;
+        else if (memcmp(found, expected, patch->length) != 0)
+        {
+            fprintf(err, "The bytes of %s at %lu aren't those of the plan!\n", file->filename, patch->offset);
+            rv = 3; goto RET;
+        }
+    }
+
+    if (changed && *current < file->count)
+    {
+        fprintf(err, "The file %s changed since the plan!\n", file->filename);
+        rv = 3;
+    }
+
+  RET:
+    free(found);
+    return rv;
+}
+
+/* Check the file, then write the patches which aren't there yet, unless only checking */
+static int apply_file(Patch_File *file, int rollback, int write, FILE *out, FILE *err)
+{
+    size_t k, current, length = 0;
+    uint64_t started = 0;
+    int fd, rv;
+
+    STATS_START(started);
+
+    if ((fd = open(file->filename, O_RDWR | O_CLOEXEC)) == -1)
+    {
+        fprintf(err, "Failed to open the file %s: %s!\n", file->filename, strerror(errno));
+        return 3;
+    }
+    STATS_COUNT(SC_OPEN, 1);
+    STATS_LAP(ST_OPEN, started);
+
+    rv = check_file(file, fd, rollback, &current, err);
+    STATS_LAP(ST_LOOKUP, started);
+    if (rv != 0 || !write)
+        goto RET;
+
+    if (current == file->count)
+    {
+        fprintf(out, "Already %s: %s\n", rollback ? "rolled back" : "patched", file->filename);
+        goto RET;
+    }
+
+    fprintf(out, "%s file: %s\n", rollback ? "Rolling back" : "Patching", file->filename);
+    for (k = 0; k < file->count; k++)
+    {
+        Patch *patch = &file->patches[k];
+
+        if (patch->done)
+            continue;
+        STATS_COUNT(SC_WRITE, 1);
+        STATS_COUNT(SC_BYTES_WRITTEN, patch->length);
+        if (pwrite(fd, rollback ? patch->old : patch->new, patch->length, patch->offset) != (ssize_t)patch->length)
+        {
+            fprintf(err, "Failed to write the changes of %s: %s!\n", file->filename, strerror(errno));
+            rv = 4; goto RET;
+        }
+        patch->written = 1;
+        file->written++;
+        length += patch->length;
+    }
+    STATS_LAP(ST_WRITE, started);
+    if (length > 0)
+        PROBE2(dyngler, write_back, file->filename, length);
+
+  RET:
+    close(fd);
+
+    return rv;
+}
+
+/* Put back the bytes this run changed, and only those */
+static int undo_file(const Patch_File *file, int rollback, FILE *out, FILE *err)
+{
+    size_t k;
+    int fd, rv = 0;
+
+    if ((fd = open(file->filename, O_WRONLY | O_CLOEXEC)) == -1)
+    {
+        fprintf(err, "Failed to open the file %s: %s!\n", file->filename, strerror(errno));
+        return 4;
+    }
+    STATS_COUNT(SC_OPEN, 1);
+
+    fprintf(out, "Undoing file: %s\n", file->filename);
+    for (k = 0; k < file->count; k++)
+    {
+        const Patch *patch = &file->patches[k];
+
+        if (!patch->written)
+            continue;
+        STATS_COUNT(SC_WRITE, 1);
+        STATS_COUNT(SC_BYTES_WRITTEN, patch->length);
+        if (pwrite(fd, rollback ? patch->new : patch->old, patch->length, patch->offset) != (ssize_t)patch->length)
+        {
+            fprintf(err, "Failed to undo the changes of %s: %s!\n", file->filename, strerror(errno));
+            rv = 4;
+        }
+    }
+    close(fd);
+
+    return rv;
+}
+
+static Patch_File* read_plan(const char *planname, size_t *count, FILE *err)
+{
+    FILE *plan;
+    Patch_File *files = NULL, *grown;
+    char *line = NULL;
+    size_t size = 0, lineno = 0, capacity = 0;
+    ssize_t len;
+    int r, failed = 1;
+
+    *count = 0;
+    if (strcmp(planname, "-") == 0)
+        plan = stdin;
+    else if ((plan = fopen(planname, "r")) == NULL)
+    {
+        fprintf(err, "Failed to open the patch plan: %s!\n", strerror(errno));
+        return NULL;
+    }
+
+    while ((len = getline(&line, &size, plan)) != -1)
+    {
+        lineno++;
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+
+        if (strncmp(line, PATCH_FILE "\t", strlen(PATCH_FILE) + 1) == 0)
+        {
+            if (*count == capacity)
+            {
+                capacity = capacity == 0 ? 64 : capacity * 2;
+                if ((grown = realloc(files, sizeof(Patch_File) * capacity)) == NULL)
+                {
+                    r = -1;
+                    goto LINE;
+                }
+                files = grown;
+            }
+            memset(&files[*count], 0, sizeof(Patch_File));
+            (*count)++;
+            r = read_file(line, &files[*count - 1]);
+        }
+        else if (strncmp(line, PATCH_BYTES "\t", strlen(PATCH_BYTES) + 1) == 0 && *count > 0)
+            r = read_patch(line, &files[*count - 1]);
+        else
+            r = 0;
+
+      LINE:
+        if (r < 0)
+        {
+            fprintf(err, "Failed to allocate memory for the patch plan: %s!\n", strerror(errno));
+            goto RET;
+        }
+        if (r == 0)
+        {
+            fprintf(err, "Malformed line %lu of the patch plan!\n", (unsigned long)lineno);
+            goto RET;
+        }
+    }
+
+    if (ferror(plan))
+    {
+        fprintf(err, "Failed to read the patch plan: %s!\n", strerror(errno));
+        goto RET;
+    }
+    failed = 0;
+
+  RET:
+    free(line);
+    if (plan != stdin)
+        fclose(plan);
+
+    if (failed)
+    {
+        while (*count > 0)
+            free_file(&files[--(*count)]);
+        free(files);
+        return NULL;
+    }
+
+    /* An empty plan is valid */
+    if (files == NULL)
+        files = malloc(1);
+
+    return files;
+}
+
+int patch_apply(const char *planname, int rollback, FILE *out, FILE *err)
+{
+    Patch_File *files;
+    size_t count, k;
+    int rv = 0, r;
+
+    /* Read the whole plan first, so that a malformed line leaves every file as it is */
+    if ((files = read_plan(planname, &count, err)) == NULL)
+        return 3;
+
+    /* Then check all the files, so that nothing is written if one of them isn't as planned */
+    for (k = 0; k < count; k++)
+    {
+        if ((r = apply_file(&files[k], rollback, 0, out, err)) > rv)
+            rv = r;
+    }
+    if (rv != 0)
+    {
+        fputs("No file was changed.\n", err);
+        goto RET;
+    }
+
+    for (k = 0; k < count; k++)
+    {
+        if (stats_enabled)
+            stats_begin();
+        rv = apply_file(&files[k], rollback, 1, out, err);
+        if (stats_enabled)
+            stats_end(files[k].filename, err);
+        if (rv != 0)
+            break;
+    }
+
+    /* A file couldn't be written after all: undo the patches this run changed, the files already as wanted are left alone */
+    if (rv != 0)
+    {
+        fputs("Undoing the changes made so far.\n", err);
+        for (k = 0; k < count; k++)
+        {
+            if (files[k].written > 0)
+                undo_file(&files[k], rollback, out, err);
+        }
+    }
+
+  RET:
+    for (k = 0; k < count; k++)
+        free_file(&files[k]);
+    free(files);
+
+    return rv;
+}
@@ -0,0 +1,19 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Describe the changes of the files as patches, to apply (or roll back) without parsing them.
+ */
+
+#ifndef PATCH_H_INCLUDED
+#define PATCH_H_INCLUDED
+
+#include <stdio.h>
+#include <stddef.h>
+
+FILE* patch_create(const char *planname, FILE *err);
+int patch_file(FILE *plan, const char *filename, int fd, FILE *err);
+int patch_bytes(FILE *plan, int fd, size_t offset, const char *data, size_t length, FILE *err);
+int patch_apply(const char *planname, int rollback, FILE *out, FILE *err);
+
+#endif
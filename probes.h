@@ -0,0 +1,70 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Static probes for the tracers (bpftrace, perf, SystemTap), in the format of sys/sdt.h.
+ */
+
+#ifndef PROBES_H_INCLUDED
+#define PROBES_H_INCLUDED
+
+/* A probe is a nop in the code, described by a note in the .note.stapsdt section: the tracers
+ * replace the nop by a breakpoint when they attach, and read the arguments from the locations
+ * written in the note. Nothing runs when no tracer is attached, and nothing is needed at run time.
+ * The arguments are converted to long, so that the strings are passed as their address.
+ */
+#if defined(__GNUC__) && defined(__ELF__) && !defined(NO_PROBES)
+
+#if defined(__LP64__)
+#define PROBE_ADDR ".8byte"
+#else
+#define PROBE_ADDR ".4byte"
+#endif
+
+#define PROBE_ASM(provider, name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: " PROBE_ADDR " 990b\n" \
+    PROBE_ADDR " _.stapsdt.base\n" \
+    PROBE_ADDR " 0\n" \
+    ".asciz \"" #provider "\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+/* Printed negated by %n: "-8@%rax" describes a signed long in a register */
+#define PROBE_SIZE "n" ((int)sizeof(long))
+#define PROBE_ARG(x) "nor" ((long)(x))
+
+#define PROBE1(provider, name, a1) \
+    __asm__ __volatile__ (PROBE_ASM(provider, name, "%n[s]@%[p1]") \
+                          : : [s] PROBE_SIZE, [p1] PROBE_ARG(a1))
+#define PROBE2(provider, name, a1, a2) \
+    __asm__ __volatile__ (PROBE_ASM(provider, name, "%n[s]@%[p1] %n[s]@%[p2]") \
+                          : : [s] PROBE_SIZE, [p1] PROBE_ARG(a1), [p2] PROBE_ARG(a2))
+#define PROBE3(provider, name, a1, a2, a3) \
+    __asm__ __volatile__ (PROBE_ASM(provider, name, "%n[s]@%[p1] %n[s]@%[p2] %n[s]@%[p3]") \
+                          : : [s] PROBE_SIZE, [p1] PROBE_ARG(a1), [p2] PROBE_ARG(a2), [p3] PROBE_ARG(a3))
+
+#else
+
+#define PROBE1(provider, name, a1) do { } while (0)
+#define PROBE2(provider, name, a1, a2) do { } while (0)
+#define PROBE3(provider, name, a1, a2, a3) do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,513 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Repair the missing dependencies in two phases: plan the replacements, then apply them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "repair.h"
+#include "scanindex.h"
+#include "stats.h"
+
+/* The plan is a text file, to be reviewed (and edited) before being applied.
+ * Its fields are separated by tabs, the lines starting with '#' are comments:
+ *   lib   <missing library>  <room>  <replacement, empty when none fits>
+ *   file  <absolute path>    <missing library>  <room>  [<missing library>  <room>]...
+ * The room is the length a name can take in the string table of a file, so a missing
+ * library is resolved once for each room it has.
+ */
+#define PLAN_LIBRARY "lib"
+#define PLAN_FILE    "file"
+
+/* A missing library, resolved for a room */
+typedef struct
+{
+    const char *old;
+    size_t available;
+    const char *new;
+} Planned_Library;
+
+static int compare_libraries(const void *a, const void *b)
+{
+    const Planned_Library *la = a, *lb = b;
+    const int c = strcmp(la->old, lb->old);
+
+    if (c != 0)
+        return c;
+    return la->available < lb->available ? -1 : la->available > lb->available;
+}
+
+static const Planned_Library* find_library(const Planned_Library *libraries, size_t count, const char *name, size_t available)
+{
+    Planned_Library key;
+
+    key.old = name;
+    key.available = available;
+    key.new = NULL;
+    return bsearch(&key, libraries, count, sizeof(Planned_Library), compare_libraries);
+}
+
+static int plannable(const char *name)
+{
+    /* The names holding a separator can't be written in the plan */
+    return strpbrk(name, "\t\n") == NULL;
+}
+
+int repair_gather(LD_Cache *ldcache, struct Scan_Index *index, const char *filename, Repair_File *file, FILE *err)
+{
+    Dynamics *dynamics;
+    const char *path;
+    char *names;
+    size_t k, size = 0;
+    uint64_t started = 0;
+    int rv = 0;
+
+    /* Read the dynamic strings, or their copy in the index if the file didn't change */
+    if ((dynamics = scanindex_read(index, filename, err)) == NULL)
+        return 3;
+
+    STATS_START(started);
+
+    /* The "runpath" is the one used when both are present */
+    path = dynamics->runpath != NULL ? dynamics->runpath : dynamics->rpath;
+    if (path != NULL && !ldcache_setpath(ldcache, path, filename))
+    {
+        fprintf(err, "Failed to allocate memory for the stored path: %s!\n", strerror(errno));
+        rv = 3; goto RET;
+    }
+
+    /* Room for all the needed libraries, the missing ones are a few at most */
+    for (k = 0; k < dynamics->neededlen; k++)
+        size += strlen(dynamics->needed[k]) + 1;
+    if ((file->replacements = malloc((sizeof(Replacement) + sizeof(size_t)) * (dynamics->neededlen + 1) + size)) == NULL)
+    {
+        fprintf(err, "Failed to allocate memory for the missing libraries: %s!\n", strerror(errno));
+        rv = 3; goto RET;
+    }
+    file->available = (size_t*)(file->replacements + dynamics->neededlen + 1);
+    names = (char*)(file->available + dynamics->neededlen + 1);
+
+    /* Keep the libraries that are found nowhere, they are resolved later, once for all the files */
+    for (k = 0; k < dynamics->neededlen; k++)
+    {
+        if (ldcache_search(ldcache, dynamics->needed[k]))
+            continue;
+
+        strcpy(names, dynamics->needed[k]);
+        file->replacements[file->count].old = names;
+        file->replacements[file->count].new = NULL;
+        file->count++;
+        names += strlen(names) + 1;
+    }
+    file->replacements[file->count].old = NULL;
+    file->replacements[file->count].new = NULL;
+
+    if (file->count == 0)
+    {
+        free(file->replacements);
+        file->replacements = NULL;
+        file->available = NULL;
+    }
+    /* The index only keeps the names, their room is measured in the file itself */
+    else
+        rv = dynamics_room(filename, file->replacements, file->count, file->available, err);
+
+  RET:
+    STATS_LAP(ST_RESOLVE, started);
+    free(dynamics);
+
+    return rv;
+}
+
+int repair_write(const LD_Cache *ldcache, const char *const *files, Repair_File *repairs, size_t count, const char *planname, FILE *out, FILE *err)
+{
+    FILE *plan;
+    Planned_Library *libraries;
+    const Planned_Library *library;
+    char *path;
+    size_t k, j, total = 0, unique = 0, unresolved = 0;
+    uint64_t started = 0;
+    int rv = 0;
+
+    for (k = 0; k < count; k++)
+        total += repairs[k].count;
+
+    if ((libraries = malloc(sizeof(Planned_Library) * (total > 0 ? total : 1))) == NULL)
+    {
+        fprintf(err, "Failed to allocate memory for the missing libraries: %s!\n", strerror(errno));
+        return 3;
+    }
+
+    /* Merge the missing libraries of all the files, by room */
+    for (k = 0; k < count; k++)
+    {
+        for (j = 0; j < repairs[k].count; j++)
+        {
+            libraries[unique].old = repairs[k].replacements[j].old;
+            libraries[unique].available = repairs[k].available[j];
+            unique++;
+        }
+    }
+    if (unique > 0)
+    {
+        qsort(libraries, unique, sizeof(Planned_Library), compare_libraries);
+        for (k = 1, j = 0; k < unique; k++)
+        {
+            if (compare_libraries(&libraries[k], &libraries[j]) != 0)
+                libraries[++j] = libraries[k];
+        }
+        unique = j + 1;
+    }
+
+    /* Resolve each of them once, with the closest library that fits, as --repair-deps does */
+    STATS_START(started);
+    for (k = 0; k < unique; k++)
+    {
+        if ((libraries[k].new = ldcache_replacement(ldcache, libraries[k].old, libraries[k].available)) == NULL)
+            unresolved++;
+    }
+    STATS_LAP(ST_RESOLVE, started);
+
+    /* Attribute the replacements to the files */
+    for (k = 0; k < count; k++)
+    {
+        for (j = 0; j < repairs[k].count; j++)
+            repairs[k].replacements[j].new = find_library(libraries, unique, repairs[k].replacements[j].old, repairs[k].available[j])->new;
+    }
+
+    if (strcmp(planname, "-") == 0)
+        plan = stdout;
+    else if ((plan = fopen(planname, "w")) == NULL)
+    {
+        fprintf(err, "Failed to open the repair plan: %s!\n", strerror(errno));
+        free(libraries);
+        return 4;
+    }
+
+    fputs("# Repair plan of dyngler, to be applied with --repair-apply.\n"
+          "# The replacements may be edited: an empty one leaves the library as it is.\n", plan);
+    for (k = 0; k < unique; k++)
+    {
+        library = &libraries[k];
+        if (!plannable(library->old) || (library->new != NULL && !plannable(library->new)))
+        {
+            fprintf(err, "The library %s can't be written in the plan!\n", library->old);
+            continue;
+        }
+        fprintf(plan, PLAN_LIBRARY "\t%s\t%lu\t%s\n", library->old, (unsigned long)library->available, library->new != NULL ? library->new : "");
+
+        /* The plan itself is the report when it goes to the standard output */
+        if (plan != stdout)
+            fprintf(out, "%s => %s\n", library->old, library->new != NULL ? library->new : "NOT FOUND!");
+    }
+    for (k = 0; k < count; k++)
+    {
+        if (repairs[k].count == 0)
+            continue;
+
+        /* The plan may be applied from another directory */
+        if ((path = realpath(files[k], NULL)) == NULL)
+        {
+            fprintf(err, "Failed to resolve the path of the file %s: %s!\n", files[k], strerror(errno));
+            rv = 3;
+            continue;
+        }
+        if (!plannable(path))
+        {
+            fprintf(err, "The file %s can't be written in the plan!\n", path);
+            free(path);
+            continue;
+        }
+        fprintf(plan, PLAN_FILE "\t%s", path);
+        for (j = 0; j < repairs[k].count; j++)
+            fprintf(plan, "\t%s\t%lu", repairs[k].replacements[j].old, (unsigned long)repairs[k].available[j]);
+        fputc('\n', plan);
+        free(path);
+    }
+
+    if (fflush(plan) != 0 || ferror(plan))
+    {
+        fprintf(err, "Failed to write the repair plan: %s!\n", strerror(errno));
+        rv = 4;
+    }
+    if (plan != stdout && fclose(plan) != 0 && rv == 0)
+    {
+        fprintf(err, "Failed to write the repair plan: %s!\n", strerror(errno));
+        rv = 4;
+    }
+
+    /* Like the replacement query, tell when some libraries can't be repaired */
+    if (rv == 0 && unresolved > 0)
+        rv = 5;
+
+    free(libraries);
+
+    return rv;
+}
+
+static char* read_plan(const char *planname, size_t *length, FILE *err)
+{
+    FILE *plan;
+    char *content = NULL, *grown;
+    size_t capacity = 0, n;
+
+    if (strcmp(planname, "-") == 0)
+        plan = stdin;
+    else if ((plan = fopen(planname, "r")) == NULL)
+    {
+        fprintf(err, "Failed to open the repair plan: %s!\n", strerror(errno));
+        return NULL;
+    }
+
+    /* Read the whole plan, the names are used in place */
+    *length = 0;
+    for (;;)
+    {
+        /* Keep a byte for the terminating zero */
+        if (*length + 1 >= capacity)
+        {
+            capacity = capacity == 0 ? 65536 : capacity * 2;
+            if ((grown = realloc(content, capacity)) == NULL)
+            {
+                fprintf(err, "Failed to allocate memory for the repair plan: %s!\n", strerror(errno));
+                free(content);
+                content = NULL;
+                break;
+            }
+            content = grown;
+        }
+        if ((n = fread(content + *length, 1, capacity - *length - 1, plan)) == 0)
+            break;
+        *length += n;
+    }
+
+    if (content != NULL && ferror(plan))
+    {
+        fprintf(err, "Failed to read the repair plan: %s!\n", strerror(errno));
+        free(content);
+        content = NULL;
+    }
+    if (content != NULL)
+        content[*length] = '\0';
+
+    if (plan != stdin)
+        fclose(plan);
+
+    return content;
+}
+
+static int read_room(const char *str, size_t *available)
+{
+    char *end;
+
+    if (str[0] < '0' || str[0] > '9')
+        return 0;
+
+    errno = 0;
+    *available = strtoul(str, &end, 10);
+    return errno == 0 && *end == '\0';
+}
+
+static int read_file(const Planned_Library *libraries, size_t unique, char *line, char **filename, Repair_File *file, FILE *err)
+{
+    const Planned_Library *library;
+    char *end = line + strlen(line), *name, *room, *strings;
+    size_t fields = 0, size = 0, available;
+
+    /* Split the line in place: the file, then its missing libraries with their room */
+    for (name = line; (name = strchr(name, '\t')) != NULL; )
+        *name++ = '\0';
+    line += strlen(PLAN_FILE) + 1;
+
+    /* Measure the libraries having a replacement, both names are copied */
+    for (name = line + strlen(line) + 1; name < end; name = room + strlen(room) + 1)
+    {
+        room = name + strlen(name) + 1;
+        if (room >= end || !read_room(room, &available))
+        {
+            fprintf(err, "Malformed entry of %s in the repair plan!\n", line);
+            return 0;
+        }
+        if ((library = find_library(libraries, unique, name, available)) != NULL && library->new != NULL)
+        {
+            fields++;
+            size += strlen(name) + strlen(library->new) + 2;
+        }
+    }
+
+    /* Nothing to do on this file */
+    if (fields == 0)
+        return 1;
+
+    if (fields > REP_MAXIMUM)
+    {
+        fprintf(err, "Only the first %d replacements of %s will be applied!\n", REP_MAXIMUM, line);
+        fields = REP_MAXIMUM;
+    }
+
+    if ((*filename = malloc(strlen(line) + 1)) == NULL
+     || (file->replacements = malloc(sizeof(Replacement) * (fields + 1) + size)) == NULL)
+    {
+        fprintf(err, "Failed to allocate memory for the replacements: %s!\n", strerror(errno));
+        free(*filename);
+        *filename = NULL;
+        return 0;
+    }
+    strcpy(*filename, line);
+    strings = (char*)(file->replacements + fields + 1);
+
+    for (name = line + strlen(line) + 1; name < end && file->count < fields; name = room + strlen(room) + 1)
+    {
+        room = name + strlen(name) + 1;
+        read_room(room, &available);
+        if ((library = find_library(libraries, unique, name, available)) == NULL || library->new == NULL)
+            continue;
+
+        file->replacements[file->count].old = strcpy(strings, name);
+        strings += strlen(name) + 1;
+        file->replacements[file->count].new = strcpy(strings, library->new);
+        strings += strlen(library->new) + 1;
+        file->count++;
+    }
+    file->replacements[file->count].old = NULL;
+    file->replacements[file->count].new = NULL;
+
+    return 1;
+}
+
+int repair_read(const char *planname, char ***files, Repair_File **repairs, size_t *count, FILE *err)
+{
+    Planned_Library *libraries = NULL, *grownLibraries;
+    Repair_File *grownRepairs;
+    char **fileLines = NULL, **grownLines, **grownFiles, *content, *line, *next, *room, *name, *tab;
+    size_t length, lineno = 0, unique = 0, libraryCapacity = 0, lines = 0, lineCapacity = 0, capacity = 0, k;
+    int rv = 0;
+
+    *files = NULL;
+    *repairs = NULL;
+    *count = 0;
+
+    if ((content = read_plan(planname, &length, err)) == NULL)
+        return 3;
+
+    /* First the libraries, whose lines may be anywhere */
+    for (line = content; line < content + length; line = next)
+    {
+        lineno++;
+        if ((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+        else
+            next = content + length;
+
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        if (strncmp(line, PLAN_FILE "\t", strlen(PLAN_FILE) + 1) == 0)
+        {
+            if (lines == lineCapacity)
+            {
+                lineCapacity = lineCapacity == 0 ? 64 : lineCapacity * 2;
+                if ((grownLines = realloc(fileLines, sizeof(char*) * lineCapacity)) == NULL)
+                    goto MEMORY;
+                fileLines = grownLines;
+            }
+            fileLines[lines++] = line;
+            continue;
+        }
+
+        if (strncmp(line, PLAN_LIBRARY "\t", strlen(PLAN_LIBRARY) + 1) != 0 ||
+            (room = strchr(line + strlen(PLAN_LIBRARY) + 1, '\t')) == NULL || (name = strchr(room + 1, '\t')) == NULL)
+        {
+            fprintf(err, "Malformed line %lu of the repair plan!\n", (unsigned long)lineno);
+            rv = 3; goto RET;
+        }
+
+        if (unique == libraryCapacity)
+        {
+            libraryCapacity = libraryCapacity == 0 ? 64 : libraryCapacity * 2;
+            if ((grownLibraries = realloc(libraries, sizeof(Planned_Library) * libraryCapacity)) == NULL)
+                goto MEMORY;
+            libraries = grownLibraries;
+        }
+
+        /* An empty replacement leaves the library as it is */
+        *room++ = '\0';
+        *name++ = '\0';
+        if ((tab = strchr(name, '\t')) != NULL)
+            *tab = '\0';
+        if (!read_room(room, &libraries[unique].available))
+        {
+            fprintf(err, "Malformed line %lu of the repair plan!\n", (unsigned long)lineno);
+            rv = 3; goto RET;
+        }
+        libraries[unique].old = line + strlen(PLAN_LIBRARY) + 1;
+        libraries[unique].new = name[0] != '\0' ? name : NULL;
+        unique++;
+    }
+    if (unique > 0)
+        qsort(libraries, unique, sizeof(Planned_Library), compare_libraries);
+
+    /* Then the files, with the replacements of their missing libraries */
+    for (k = 0; k < lines; k++)
+    {
+        if (*count == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            if ((grownFiles = realloc(*files, sizeof(char*) * capacity)) == NULL)
+                goto MEMORY;
+            *files = grownFiles;
+            if ((grownRepairs = realloc(*repairs, sizeof(Repair_File) * capacity)) == NULL)
+                goto MEMORY;
+            *repairs = grownRepairs;
+        }
+
+        (*files)[*count] = NULL;
+        memset(&(*repairs)[*count], 0, sizeof(Repair_File));
+        if (!read_file(libraries, unique, fileLines[k], &(*files)[*count], &(*repairs)[*count], err))
+        {
+            rv = 3; goto RET;
+        }
+
+        /* The files left as they are don't need to be opened */
+        if ((*repairs)[*count].count > 0)
+            (*count)++;
+    }
+    goto RET;
+
+  MEMORY:
+    fprintf(err, "Failed to allocate memory for the repair plan: %s!\n", strerror(errno));
+    rv = 3;
+
+  RET:
+    if (rv != 0)
+    {
+        for (k = 0; k < *count; k++)
+            free((*files)[k]);
+        free(*files);
+        repair_free(*repairs, *count);
+        *files = NULL;
+        *repairs = NULL;
+        *count = 0;
+    }
+    free(fileLines);
+    free(libraries);
+    free(content);
+
+    return rv;
+}
+
+void repair_free(Repair_File *repairs, size_t count)
+{
+    size_t k;
+
+    if (repairs == NULL)
+        return;
+
+    for (k = 0; k < count; k++)
+        free(repairs[k].replacements);
+    free(repairs);
+}
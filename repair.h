@@ -0,0 +1,36 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Repair the missing dependencies in two phases: plan the replacements, then apply them.
+ */
+
+#ifndef REPAIR_H_INCLUDED
+#define REPAIR_H_INCLUDED
+
+#include <stdio.h>
+#include "dynamic.h"
+
+typedef enum
+{
+    RP_NONE,
+    RP_PLAN,  /* Gather the missing libraries of the files, and resolve each one once */
+    RP_APPLY  /* Apply the replacements of a plan, without resolving anything */
+} Repair_Phase;
+
+/* The missing libraries of a file, with their replacements */
+typedef struct
+{
+    Replacement *replacements; /* Terminated by an empty one, the new names are NULL when unresolved */
+    size_t *available;         /* The room of each missing name in the file, when gathered */
+    size_t count;
+} Repair_File;
+
+struct Scan_Index;
+
+int repair_gather(LD_Cache *ldcache, struct Scan_Index *index, const char *filename, Repair_File *file, FILE *err);
+int repair_write(const LD_Cache *ldcache, const char *const *files, Repair_File *repairs, size_t count, const char *planname, FILE *out, FILE *err);
+int repair_read(const char *planname, char ***files, Repair_File **repairs, size_t *count, FILE *err);
+void repair_free(Repair_File *repairs, size_t count);
+
+#endif
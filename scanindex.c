@@ -0,0 +1,840 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Keep the dynamic strings of the scanned files on disk, to parse only the files which changed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "json.h"
+#include "scanindex.h"
+#include "stats.h"
+
+static int compare_keys(const Index_Record *a, const Index_Record *b)
+{
+    if (a->dev != b->dev)
+        return a->dev < b->dev ? -1 : 1;
+    if (a->ino != b->ino)
+        return a->ino < b->ino ? -1 : 1;
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    return compare_keys(&((const Index_Entry*)a)->key, &((const Index_Entry*)b)->key);
+}
+
+static const Index_Record* find_record(const Scan_Index *index, const Index_Record *key)
+{
+    size_t low = 0, high = index->count, middle;
+    int c;
+
+    /* The records are sorted by device and inode */
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if ((c = compare_keys(&index->records[middle], key)) == 0)
+            return &index->records[middle];
+        if (c < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return NULL;
+}
+
+static const char* index_string(const Scan_Index *index, uint32_t offset, int *valid)
+{
+    if (offset == INDEX_NONE)
+        return NULL;
+
+    /* The string has to be terminated inside the index */
+    if (offset >= index->stringlen || memchr(index->strings + offset, '\0', index->stringlen - offset) == NULL)
+    {
+        *valid = 0;
+        return NULL;
+    }
+
+    return index->strings + offset;
+}
+
+static size_t string_size(const char *str)
+{
+    return str != NULL ? strlen(str) + 1 : 0;
+}
+
+static const char* keep_string(char **strings, const char *str)
+{
+    char *copy = *strings;
+
+    if (str == NULL)
+        return NULL;
+
+    strcpy(copy, str);
+    *strings += strlen(str) + 1;
+    return copy;
+}
+
+static Dynamics* copy_dynamics(const char *soname, const char *rpath, const char *runpath, const char *const *needed, size_t neededlen)
+{
+    Dynamics *dynamics;
+    char *strings;
+    size_t k, size = string_size(soname) + string_size(rpath) + string_size(runpath);
+
+    for (k = 0; k < neededlen; k++)
+        size += string_size(needed[k]);
+
+    /* The same single allocation as the parsed dynamic strings */
+    if ((dynamics = calloc(1, sizeof(Dynamics) + sizeof(char*) * neededlen + size)) == NULL)
+        return NULL;
+    dynamics->needed = (const char**)(dynamics + 1);
+    strings = (char*)(dynamics->needed + neededlen);
+
+    dynamics->soname = keep_string(&strings, soname);
+    dynamics->rpath = keep_string(&strings, rpath);
+    dynamics->runpath = keep_string(&strings, runpath);
+    for (k = 0; k < neededlen; k++)
+        dynamics->needed[k] = keep_string(&strings, needed[k]);
+    dynamics->neededlen = neededlen;
+
+    return dynamics;
+}
+
+static Dynamics* record_dynamics(const Scan_Index *index, const Index_Record *record)
+{
+    Dynamics *dynamics;
+    const char **needed;
+    const char *soname, *rpath, *runpath;
+    size_t k;
+    int valid = 1;
+
+    if (record->needed > index->listlen || record->neededlen > index->listlen - record->needed)
+        return NULL;
+    if ((needed = malloc(sizeof(char*) * (record->neededlen > 0 ? record->neededlen : 1))) == NULL)
+        return NULL;
+
+    soname = index_string(index, record->soname, &valid);
+    rpath = index_string(index, record->rpath, &valid);
+    runpath = index_string(index, record->runpath, &valid);
+    for (k = 0; k < record->neededlen; k++)
+    {
+        if ((needed[k] = index_string(index, index->lists[record->needed + k], &valid)) == NULL)
+            valid = 0;
+    }
+
+    /* A damaged record is parsed again */
+    dynamics = valid ? copy_dynamics(soname, rpath, runpath, needed, record->neededlen) : NULL;
+    if (dynamics != NULL)
+    {
+        dynamics->machine = record->machine;
+        dynamics->e32 = record->e32;
+    }
+
+    free(needed);
+    return dynamics;
+}
+
+static int map_index(Scan_Index *index)
+{
+    const Index_Header *header;
+    struct stat stats;
+    int fd;
+
+    if ((fd = open(index->filename, O_RDONLY | O_CLOEXEC)) == -1)
+        return errno == ENOENT;
+    STATS_COUNT(SC_OPEN, 1);
+    STATS_COUNT(SC_STAT, 1);
+
+    if (fstat(fd, &stats) != 0 || (size_t)stats.st_size < sizeof(Index_Header))
+    {
+        close(fd);
+        return 0;
+    }
+
+    index->size = stats.st_size;
+    index->map = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index->map == MAP_FAILED)
+    {
+        index->map = NULL;
+        return 0;
+    }
+    STATS_COUNT(SC_MAP, 1);
+    STATS_COUNT(SC_BYTES_MAPPED, index->size);
+
+    /* Check the layout before trusting any offset */
+    header = index->map;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header->order != INDEX_ORDER ||
+        header->size != index->size || header->lists % sizeof(uint32_t) != 0 ||
+        header->names % sizeof(uint32_t) != 0 || header->postings % sizeof(uint32_t) != 0 ||
+        header->lists < sizeof(Index_Header) || header->lists > header->names || header->names > header->postings ||
+        header->postings > header->strings || header->strings > header->size ||
+        header->count > (header->lists - sizeof(Index_Header)) / sizeof(Index_Record) ||
+        header->namecount > (header->postings - header->names) / sizeof(Index_Name))
+        return 0;
+
+    index->records = (const Index_Record*)(header + 1);
+    index->count = header->count;
+    index->lists = (const uint32_t*)((const char*)index->map + header->lists);
+    index->listlen = (header->names - header->lists) / sizeof(uint32_t);
+    index->names = (const Index_Name*)((const char*)index->map + header->names);
+    index->namecount = header->namecount;
+    index->postings = (const uint32_t*)((const char*)index->map + header->postings);
+    index->postinglen = (header->strings - header->postings) / sizeof(uint32_t);
+    index->strings = (const char*)index->map + header->strings;
+    index->stringlen = header->size - header->strings;
+
+    return 1;
+}
+
+Scan_Index* scanindex_open(const char *filename)
+{
+    Scan_Index *index;
+
+    if ((index = calloc(1, sizeof(Scan_Index))) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the index: %s!\n", strerror(errno));
+        return NULL;
+    }
+    if ((index->filename = malloc(strlen(filename) + 1)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the index: %s!\n", strerror(errno));
+        free(index);
+        return NULL;
+    }
+    strcpy(index->filename, filename);
+    pthread_mutex_init(&index->lock, NULL);
+
+    /* An index which can't be used is rebuilt from scratch */
+    if (!map_index(index))
+    {
+        fprintf(stderr, "Warning! The index %s can't be read, it will be rebuilt.\n", filename);
+        if (index->map != NULL)
+            munmap(index->map, index->size);
+        index->map = NULL;
+        index->count = 0;
+    }
+
+    return index;
+}
+
+static char* index_path(const char *filename)
+{
+    char *path, *cwd = NULL;
+
+    /* The files are found again from anywhere: the relative ones are joined to the directory, the path being kept as scanned */
+    if (filename[0] != '/' && (cwd = getcwd(NULL, 0)) != NULL)
+    {
+        while (filename[0] == '.' && filename[1] == '/')
+        {
+            filename += 2;
+            while (filename[0] == '/')
+                filename++;
+        }
+    }
+
+    if ((path = malloc((cwd != NULL ? strlen(cwd) + 1 : 0) + strlen(filename) + 1)) != NULL)
+    {
+        if (cwd != NULL)
+            sprintf(path, "%s%s%s", cwd, strcmp(cwd, "/") == 0 ? "" : "/", filename);
+        else
+            strcpy(path, filename);
+    }
+    free(cwd);
+    return path;
+}
+
+Dynamics* scanindex_read(Scan_Index *index, const char *filename, FILE *err)
+{
+    Index_Record key;
+    const Index_Record *record;
+    Dynamics *dynamics, *copy;
+    Index_Entry *grown;
+    struct stat stats;
+    char *path;
+
+    if (index == NULL)
+        return dynamics_read(filename, err);
+    STATS_COUNT(SC_STAT, 1);
+    if (stat(filename, &stats) != 0)
+        return dynamics_read(filename, err);
+
+    memset(&key, 0, sizeof(Index_Record));
+    key.dev = stats.st_dev;
+    key.ino = stats.st_ino;
+    key.size = stats.st_size;
+    key.mtime = (uint64_t)stats.st_mtim.tv_sec * 1000000000u + stats.st_mtim.tv_nsec;
+
+    /* Use the record of the file, if it didn't change since */
+    if ((record = find_record(index, &key)) != NULL && record->size == key.size && record->mtime == key.mtime)
+    {
+        if ((dynamics = record_dynamics(index, record)) != NULL)
+            return dynamics;
+    }
+
+    if ((dynamics = dynamics_read(filename, err)) == NULL)
+        return NULL;
+
+    /* Keep a copy, to be saved in the index */
+    if ((copy = copy_dynamics(dynamics->soname, dynamics->rpath, dynamics->runpath, dynamics->needed, dynamics->neededlen)) == NULL)
+        return dynamics;
+    copy->machine = dynamics->machine;
+    copy->e32 = dynamics->e32;
+    if ((path = index_path(filename)) == NULL)
+    {
+        free(copy);
+        return dynamics;
+    }
+
+    pthread_mutex_lock(&index->lock);
+    if (index->addedlen == index->addedcap)
+    {
+        const size_t newCapacity = index->addedcap == 0 ? 256 : index->addedcap * 2;
+        if ((grown = realloc(index->added, sizeof(Index_Entry) * newCapacity)) == NULL)
+        {
+            pthread_mutex_unlock(&index->lock);
+            free(copy);
+            free(path);
+            return dynamics;
+        }
+        index->added = grown;
+        index->addedcap = newCapacity;
+    }
+    index->added[index->addedlen].key = key;
+    index->added[index->addedlen].dynamics = copy;
+    index->added[index->addedlen].path = path;
+    index->addedlen++;
+    pthread_mutex_unlock(&index->lock);
+
+    return dynamics;
+}
+
+/* The strings of the index being saved, each one stored once */
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+    uint32_t *slots; /* Offsets of the strings plus one, 0 for an empty slot */
+    size_t slotcap;  /* A power of two */
+    size_t used;
+    int failed;
+} String_Table;
+
+/* A needed library, and the record of the file needing it */
+typedef struct
+{
+    uint32_t name;
+    uint32_t record;
+} Index_Pair;
+
+static size_t hash_string(const char *str)
+{
+    size_t hash = 2166136261u;
+
+    while (*str != '\0')
+        hash = (hash ^ (unsigned char)*str++) * 16777619u;
+
+    return hash;
+}
+
+static size_t string_slot(const String_Table *table, const char *str)
+{
+    const size_t mask = table->slotcap - 1;
+    size_t slot = hash_string(str) & mask;
+
+    while (table->slots[slot] != 0 && strcmp(table->data + table->slots[slot] - 1, str) != 0)
+        slot = (slot + 1) & mask;
+
+    return slot;
+}
+
+static uint32_t put_string(String_Table *table, const char *str)
+{
+    uint32_t *slots, *previous;
+    char *data;
+    size_t k, slot, len, capacity;
+
+    if (str == NULL || table->failed)
+        return INDEX_NONE;
+
+    /* Keep the load factor under one half */
+    if ((table->used + 1) * 2 > table->slotcap)
+    {
+        capacity = table->slotcap == 0 ? 1024 : table->slotcap * 2;
+        if ((slots = calloc(capacity, sizeof(uint32_t))) == NULL)
+            goto FAILED;
+        previous = table->slots;
+        len = table->slotcap;
+        table->slots = slots;
+        table->slotcap = capacity;
+        for (k = 0; k < len; k++)
+        {
+            if (previous[k] != 0)
+                slots[string_slot(table, table->data + previous[k] - 1)] = previous[k];
+        }
+        free(previous);
+    }
+
+    /* The libraries are needed by many files, store their names once */
+    if (table->slots[slot = string_slot(table, str)] != 0)
+        return table->slots[slot] - 1;
+
+    len = strlen(str) + 1;
+    if (table->length + len > table->capacity)
+    {
+        capacity = table->capacity == 0 ? 65536 : table->capacity * 2;
+        while (capacity < table->length + len)
+            capacity *= 2;
+        if ((data = realloc(table->data, capacity)) == NULL)
+            goto FAILED;
+        table->data = data;
+        table->capacity = capacity;
+    }
+
+    memcpy(table->data + table->length, str, len);
+    table->slots[slot] = table->length + 1;
+    table->length += len;
+    table->used++;
+
+    return table->slots[slot] - 1;
+
+  FAILED:
+    table->failed = 1;
+    return INDEX_NONE;
+}
+
+static void put_record(FILE *records, FILE *lists, String_Table *strings, const Index_Record *key, const Dynamics *dynamics, const char *path)
+{
+    Index_Record record;
+    uint32_t offset;
+    size_t k;
+
+    memset(&record, 0, sizeof(Index_Record));
+    record.dev = key->dev;
+    record.ino = key->ino;
+    record.size = key->size;
+    record.mtime = key->mtime;
+    record.soname = put_string(strings, dynamics->soname);
+    record.rpath = put_string(strings, dynamics->rpath);
+    record.runpath = put_string(strings, dynamics->runpath);
+    record.path = put_string(strings, path);
+    record.needed = ftell(lists) / sizeof(uint32_t);
+    record.neededlen = dynamics->neededlen;
+    record.machine = dynamics->machine;
+    record.e32 = dynamics->e32;
+
+    for (k = 0; k < dynamics->neededlen; k++)
+    {
+        offset = put_string(strings, dynamics->needed[k]);
+        fwrite(&offset, sizeof(uint32_t), 1, lists);
+    }
+
+    fwrite(&record, sizeof(Index_Record), 1, records);
+}
+
+static int compare_pairs(const void *a, const void *b)
+{
+    const Index_Pair *pa = a, *pb = b;
+
+    if (pa->name != pb->name)
+        return pa->name < pb->name ? -1 : 1;
+    if (pa->record != pb->record)
+        return pa->record < pb->record ? -1 : 1;
+    return 0;
+}
+
+static int compare_names(const void *a, const void *b, void *strings)
+{
+    return strcmp((const char*)strings + ((const Index_Name*)a)->name, (const char*)strings + ((const Index_Name*)b)->name);
+}
+
+/* Invert the lists of needed libraries: for each library, the records of the files needing it */
+static int invert_lists(const Index_Record *records, size_t count, const uint32_t *lists, const char *strings,
+                        Index_Name **names, size_t *namecount, uint32_t **postings, size_t *postinglen)
+{
+    Index_Pair *pairs;
+    size_t k, j, n = 0;
+
+    for (k = 0; k < count; k++)
+        n += records[k].neededlen;
+
+    *namecount = *postinglen = 0;
+    *names = NULL;
+    *postings = NULL;
+    if (n == 0)
+        return 1;
+    if ((pairs = malloc(sizeof(Index_Pair) * n)) == NULL)
+        return 0;
+    if ((*names = malloc(sizeof(Index_Name) * n)) == NULL || (*postings = malloc(sizeof(uint32_t) * n)) == NULL)
+    {
+        free(*names);
+        *names = NULL;
+        free(pairs);
+        return 0;
+    }
+
+    /* The names are stored once, so their offsets identify them */
+    for (k = 0, n = 0; k < count; k++)
+    {
+        for (j = 0; j < records[k].neededlen; j++)
+        {
+            pairs[n].name = lists[records[k].needed + j];
+            pairs[n].record = k;
+            n++;
+        }
+    }
+    qsort(pairs, n, sizeof(Index_Pair), compare_pairs);
+
+    for (k = 0; k < n; k++)
+    {
+        if (k == 0 || pairs[k].name != pairs[k - 1].name)
+        {
+            (*names)[*namecount].name = pairs[k].name;
+            (*names)[*namecount].first = *postinglen;
+            (*names)[*namecount].count = 0;
+            (*namecount)++;
+        }
+        /* The same library needed twice by a file */
+        else if (pairs[k].record == pairs[k - 1].record)
+            continue;
+
+        (*postings)[(*postinglen)++] = pairs[k].record;
+        (*names)[*namecount - 1].count++;
+    }
+
+    /* The names are searched by their string */
+    qsort_r(*names, *namecount, sizeof(Index_Name), compare_names, (void*)strings);
+
+    free(pairs);
+    return 1;
+}
+
+static int write_all(int fd, const void *data, size_t length)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (length > 0)
+    {
+        if ((n = write(fd, p, length)) <= 0)
+            return 0;
+        STATS_COUNT(SC_WRITE, 1);
+        STATS_COUNT(SC_BYTES_WRITTEN, n);
+        p += n;
+        length -= n;
+    }
+
+    return 1;
+}
+
+static int still_there(const Index_Record *record, const char *path)
+{
+    struct stat stats;
+
+    STATS_COUNT(SC_STAT, 1);
+    return stat(path, &stats) == 0 && (uint64_t)stats.st_dev == record->dev && (uint64_t)stats.st_ino == record->ino;
+}
+
+int scanindex_save(Scan_Index *index)
+{
+    Index_Header header;
+    String_Table strings;
+    FILE *records = NULL, *lists = NULL;
+    char *recordsBuf = NULL, *listsBuf = NULL, *tmpname = NULL;
+    size_t recordsLen = 0, listsLen = 0, namecount = 0, postinglen = 0, i = 0, j = 0;
+    Index_Name *names = NULL;
+    uint32_t *postings = NULL;
+    Dynamics *dynamics;
+    const char *path;
+    int fd = -1, rv = 0, c, valid;
+
+    /* Nothing new to remember */
+    if (index->addedlen == 0)
+        return 1;
+
+    memset(&strings, 0, sizeof(String_Table));
+    if ((records = open_memstream(&recordsBuf, &recordsLen)) == NULL ||
+        (lists = open_memstream(&listsBuf, &listsLen)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the index: %s!\n", strerror(errno));
+        goto RET;
+    }
+
+    /* Merge the sorted records with the files parsed during this run, which replace them */
+    qsort(index->added, index->addedlen, sizeof(Index_Entry), compare_entries);
+    while (i < index->count || j < index->addedlen)
+    {
+        if (j == index->addedlen)
+            c = -1;
+        else if (i == index->count)
+            c = 1;
+        else
+            c = compare_keys(&index->records[i], &index->added[j].key);
+
+        if (c < 0)
+        {
+            /* Forget the files removed or replaced since */
+            valid = 1;
+            path = index_string(index, index->records[i].path, &valid);
+            if (path != NULL && still_there(&index->records[i], path) &&
+                (dynamics = record_dynamics(index, &index->records[i])) != NULL)
+            {
+                put_record(records, lists, &strings, &index->records[i], dynamics, path);
+                free(dynamics);
+            }
+            i++;
+            continue;
+        }
+        if (c == 0)
+            i++;
+
+        /* The same file may have been parsed twice, keep the last */
+        if (j + 1 < index->addedlen && compare_entries(&index->added[j], &index->added[j + 1]) == 0)
+        {
+            j++;
+            continue;
+        }
+        put_record(records, lists, &strings, &index->added[j].key, index->added[j].dynamics, index->added[j].path);
+        j++;
+    }
+
+    fclose(records);
+    fclose(lists);
+    records = lists = NULL;
+
+    memset(&header, 0, sizeof(Index_Header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.order = INDEX_ORDER;
+    header.count = recordsLen / sizeof(Index_Record);
+
+    /* The files needing each library are found from the lists just written */
+    if (strings.failed || !invert_lists((const Index_Record*)recordsBuf, header.count, (const uint32_t*)listsBuf, strings.data,
+                                        &names, &namecount, &postings, &postinglen))
+    {
+        fprintf(stderr, "Failed to allocate memory for the index: %s!\n", strerror(errno));
+        goto RET;
+    }
+
+    header.lists = sizeof(Index_Header) + recordsLen;
+    header.names = header.lists + listsLen;
+    header.namecount = namecount;
+    header.postings = header.names + sizeof(Index_Name) * namecount;
+    header.strings = header.postings + sizeof(uint32_t) * postinglen;
+    header.size = header.strings + strings.length;
+
+    /* Replace the index at once, so that a reader never sees it half written */
+    if ((tmpname = malloc(strlen(index->filename) + 8)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the index: %s!\n", strerror(errno));
+        goto RET;
+    }
+    sprintf(tmpname, "%s.XXXXXX", index->filename);
+    if ((fd = mkstemp(tmpname)) == -1)
+    {
+        fprintf(stderr, "Failed to create the index: %s!\n", strerror(errno));
+        goto RET;
+    }
+    if (!write_all(fd, &header, sizeof(Index_Header)) || !write_all(fd, recordsBuf, recordsLen) ||
+        !write_all(fd, listsBuf, listsLen) || !write_all(fd, names, sizeof(Index_Name) * namecount) ||
+        !write_all(fd, postings, sizeof(uint32_t) * postinglen) || !write_all(fd, strings.data, strings.length))
+    {
+        fprintf(stderr, "Failed to write the index: %s!\n", strerror(errno));
+        unlink(tmpname);
+        goto RET;
+    }
+
+    /* The content has to be on the disk before the name points to it */
+    if (fsync(fd) != 0)
+    {
+        fprintf(stderr, "Failed to flush the index: %s!\n", strerror(errno));
+        unlink(tmpname);
+        goto RET;
+    }
+    if (rename(tmpname, index->filename) != 0)
+    {
+        fprintf(stderr, "Failed to replace the index: %s!\n", strerror(errno));
+        unlink(tmpname);
+        goto RET;
+    }
+    rv = 1;
+
+  RET:
+    if (records != NULL)
+        fclose(records);
+    if (lists != NULL)
+        fclose(lists);
+    if (fd != -1)
+        close(fd);
+    free(recordsBuf);
+    free(listsBuf);
+    free(names);
+    free(postings);
+    free(strings.data);
+    free(strings.slots);
+    free(tmpname);
+
+    return rv;
+}
+
+int scanindex_update(Scan_Index *index, const char *filename, FILE *err)
+{
+    Dynamics *dynamics;
+
+    /* Only remember the file, it is saved with the index */
+    if ((dynamics = scanindex_read(index, filename, err)) == NULL)
+        return 3;
+
+    free(dynamics);
+    return 0;
+}
+
+static const Index_Name* find_name(const Scan_Index *index, const char *name)
+{
+    size_t low = 0, high = index->namecount, middle;
+    const char *str;
+    int c, valid = 1;
+
+    /* The names are sorted by string */
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if ((str = index_string(index, index->names[middle].name, &valid)) == NULL)
+            return NULL;
+        if ((c = strcmp(str, name)) == 0)
+            return &index->names[middle];
+        if (c < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return NULL;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(const char *const*)a, *(const char *const*)b);
+}
+
+/* Whether the file was parsed during this run, its record being out of date */
+static int parsed_again(const Scan_Index *index, size_t addedlen, const Index_Record *record)
+{
+    Index_Entry key;
+
+    key.key = *record;
+    return bsearch(&key, index->added, addedlen, sizeof(Index_Entry), compare_entries) != NULL;
+}
+
+int scanindex_dependents(Scan_Index *index, const char *name, const Format format, FILE *out, FILE *err)
+{
+    Json_Buffer json = { NULL, 0, 0, 0 };
+    const Index_Name *entry;
+    const Index_Record *record;
+    const char **paths = NULL, *path;
+    const size_t addedlen = index->addedlen;
+    size_t k, j, n = 0, printed = 0, count = 0;
+    int valid = 1, rv = 0;
+
+    if ((entry = find_name(index, name)) != NULL)
+    {
+        if (entry->first > index->postinglen || entry->count > index->postinglen - entry->first)
+        {
+            fprintf(err, "Failed to read the index %s: the entry of %s is out of bounds!\n", index->filename, name);
+            return 3;
+        }
+        count = entry->count;
+    }
+    if (count + addedlen > 0 && (paths = malloc(sizeof(const char*) * (count + addedlen))) == NULL)
+    {
+        fprintf(err, "Failed to allocate memory for the dependents: %s!\n", strerror(errno));
+        return 3;
+    }
+
+    /* The records are answered as they were indexed, without touching the files: the files given to this run were
+     * checked as they were parsed, they are not in the mapped index yet and replace their records */
+    if (addedlen > 0)
+        qsort(index->added, addedlen, sizeof(Index_Entry), compare_entries);
+
+    for (k = 0; k < count; k++)
+    {
+        if (index->postings[entry->first + k] >= index->count)
+            continue;
+        record = &index->records[index->postings[entry->first + k]];
+        if (parsed_again(index, addedlen, record))
+            continue;
+        if ((path = index_string(index, record->path, &valid)) != NULL)
+            paths[n++] = path;
+    }
+    for (k = 0; k < addedlen; k++)
+    {
+        for (j = 0; j < index->added[k].dynamics->neededlen; j++)
+        {
+            if (strcmp(index->added[k].dynamics->needed[j], name) == 0)
+            {
+                paths[n++] = index->added[k].path;
+                break;
+            }
+        }
+    }
+
+    /* The same file may have been indexed through several names */
+    if (n > 0)
+        qsort(paths, n, sizeof(const char*), compare_paths);
+
+    if (format == FMT_NDJSON)
+    {
+        json_raw(&json, "{");
+        json_key(&json, "name");
+        json_string(&json, name);
+        json_key(&json, "dependents");
+        json_raw(&json, "[");
+    }
+    for (k = 0; k < n; k++)
+    {
+        if (k > 0 && strcmp(paths[k], paths[k - 1]) == 0)
+            continue;
+        if (format == FMT_NDJSON)
+        {
+            if (printed++ > 0)
+                json_raw(&json, ",");
+            json_string(&json, paths[k]);
+        }
+        else
+            fprintf(out, "%s\n", paths[k]);
+    }
+    if (format == FMT_NDJSON)
+    {
+        json_raw(&json, "]}");
+        rv = json_flush(&json, out, err) ? 0 : 4;
+    }
+
+    free(paths);
+    return rv;
+}
+
+void scanindex_free(Scan_Index *index)
+{
+    size_t i;
+
+    for (i = 0; i < index->addedlen; i++)
+    {
+        free(index->added[i].dynamics);
+        free(index->added[i].path);
+    }
+
+    if (index->map != NULL)
+        munmap(index->map, index->size);
+    pthread_mutex_destroy(&index->lock);
+    free(index->added);
+    free(index->filename);
+    free(index);
+}
@@ -0,0 +1,102 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Keep the dynamic strings of the scanned files on disk, to parse only the files which changed.
+ */
+
+#ifndef SCANINDEX_H_INCLUDED
+#define SCANINDEX_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "dynamic.h"
+
+#define INDEX_MAGIC "dyngler-index2"
+#define INDEX_ORDER 0x01020304u
+
+/* Offset of an absent string */
+#define INDEX_NONE ((uint32_t)-1)
+
+/* The file is laid out as the header, the records sorted by device and inode,
+ * the lists of needed libraries (offsets of strings), the needed names sorted by string,
+ * the lists of the files needing them (indices of records), then the strings, each stored once.
+ * Everything is in the byte order of the machine, to be used in place once mapped.
+ */
+typedef struct
+{
+    char magic[16];
+    uint32_t order;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t lists;
+    uint64_t names;
+    uint64_t namecount;
+    uint64_t postings;
+    uint64_t strings;
+    uint64_t size;
+} Index_Header;
+
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime;
+    uint32_t soname;
+    uint32_t rpath;
+    uint32_t runpath;
+    uint32_t path;      /* Where the file was found */
+    uint32_t needed;
+    uint32_t neededlen;
+    uint16_t machine;
+    uint16_t e32;
+    uint32_t reserved;
+} Index_Record;
+
+/* The files needing a library */
+typedef struct
+{
+    uint32_t name;
+    uint32_t first;     /* In the postings */
+    uint32_t count;
+} Index_Name;
+
+/* A file parsed during this run */
+typedef struct
+{
+    Index_Record key;
+    Dynamics *dynamics;
+    char *path;
+} Index_Entry;
+
+typedef struct Scan_Index
+{
+    char *filename;
+    void *map;
+    size_t size;
+    const Index_Record *records;
+    size_t count;
+    const uint32_t *lists;
+    size_t listlen;
+    const Index_Name *names;
+    size_t namecount;
+    const uint32_t *postings;
+    size_t postinglen;
+    const char *strings;
+    size_t stringlen;
+    Index_Entry *added;
+    size_t addedlen;
+    size_t addedcap;
+    pthread_mutex_t lock;
+} Scan_Index;
+
+Scan_Index* scanindex_open(const char *filename);
+Dynamics* scanindex_read(Scan_Index *index, const char *filename, FILE *err);
+int scanindex_update(Scan_Index *index, const char *filename, FILE *err);
+int scanindex_dependents(Scan_Index *index, const char *name, const Format format, FILE *out, FILE *err);
+int scanindex_save(Scan_Index *index);
+void scanindex_free(Scan_Index *index);
+
+#endif
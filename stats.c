@@ -0,0 +1,93 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Measure where the time goes, and count the system calls, for each file and overall.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+int stats_enabled = 0;
+__thread Stats stats_current;
+
+static Stats total;
+static size_t files = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const phaseNames[ST_PHASES] =
+{
+    "cache", "open", "lookup", "walk", "resolve", "write"
+};
+
+uint64_t stats_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void stats_lap(const Stats_Phase phase, uint64_t started)
+{
+    /* The start is shifted by the time accounted so far, so that the phases nested in between
+     * aren't counted twice, and the same start serves for the following laps.
+     */
+    const uint64_t elapsed = stats_clock() - stats_current.accounted - started;
+
+    stats_current.phases[phase] += elapsed;
+    stats_current.accounted += elapsed;
+}
+
+static void print_stats(FILE *out, const Stats *stats)
+{
+    int k;
+
+    for (k = 0; k < ST_PHASES; k++)
+        fprintf(out, "%s%s %.3f ms", k > 0 ? ", " : "", phaseNames[k], stats->phases[k] / 1e6);
+
+    fprintf(out, "; %lu open, %lu read, %lu write, %lu stat, %lu access, %lu map",
+            (unsigned long)stats->counters[SC_OPEN], (unsigned long)stats->counters[SC_READ],
+            (unsigned long)stats->counters[SC_WRITE], (unsigned long)stats->counters[SC_STAT],
+            (unsigned long)stats->counters[SC_ACCESS], (unsigned long)stats->counters[SC_MAP]);
+
+    fprintf(out, "; %lu B read, %lu B written, %lu B mapped\n",
+            (unsigned long)stats->counters[SC_BYTES_READ], (unsigned long)stats->counters[SC_BYTES_WRITTEN],
+            (unsigned long)stats->counters[SC_BYTES_MAPPED]);
+}
+
+void stats_begin(void)
+{
+    memset(&stats_current, 0, sizeof(Stats));
+}
+
+void stats_end(const char *filename, FILE *out)
+{
+    int k;
+
+    /* The work done outside of any file (the cache) only counts in the total */
+    if (filename != NULL && out != NULL)
+    {
+        fprintf(out, "[stats] %s: ", filename);
+        print_stats(out, &stats_current);
+    }
+
+    pthread_mutex_lock(&lock);
+    for (k = 0; k < ST_PHASES; k++)
+        total.phases[k] += stats_current.phases[k];
+    for (k = 0; k < SC_COUNTERS; k++)
+        total.counters[k] += stats_current.counters[k];
+    if (filename != NULL)
+        files++;
+    pthread_mutex_unlock(&lock);
+
+    memset(&stats_current, 0, sizeof(Stats));
+}
+
+void stats_report(FILE *out)
+{
+    fprintf(out, "[stats] total (%lu file%s): ", (unsigned long)files, files == 1 ? "" : "s");
+    print_stats(out, &total);
+}
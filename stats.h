@@ -0,0 +1,63 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Measure where the time goes, and count the system calls, for each file and overall.
+ */
+
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum
+{
+    ST_CACHE,   /* Loading the ld.so.cache */
+    ST_OPEN,    /* Opening and mapping the ELF file */
+    ST_LOOKUP,  /* Finding the dynamic segment and the string table */
+    ST_WALK,    /* Going through the dynamic entries */
+    ST_RESOLVE, /* Searching the libraries in the cache and the directories */
+    ST_WRITE,   /* Writing the changes back */
+    ST_PHASES
+} Stats_Phase;
+
+typedef enum
+{
+    SC_OPEN,
+    SC_READ,
+    SC_WRITE,
+    SC_STAT,
+    SC_ACCESS,
+    SC_MAP,
+    SC_BYTES_READ,
+    SC_BYTES_WRITTEN,
+    SC_BYTES_MAPPED,
+    SC_COUNTERS
+} Stats_Counter;
+
+typedef struct
+{
+    uint64_t phases[ST_PHASES];     /* Nanoseconds */
+    uint64_t counters[SC_COUNTERS];
+    uint64_t accounted;             /* Sum of the phases */
+} Stats;
+
+/* Set once, before any worker starts */
+extern int stats_enabled;
+
+/* The statistics of the file being processed by the thread */
+extern __thread Stats stats_current;
+
+/* When the statistics are off, the counters and the clocks only cost the test of a global */
+#define STATS_COUNT(counter, n) do { if (stats_enabled) stats_current.counters[counter] += (n); } while (0)
+#define STATS_START(started) do { if (stats_enabled) (started) = stats_clock() - stats_current.accounted; } while (0)
+#define STATS_LAP(phase, started) do { if (stats_enabled) stats_lap(phase, started); } while (0)
+
+uint64_t stats_clock(void);
+void stats_lap(const Stats_Phase phase, uint64_t started);
+void stats_begin(void);
+void stats_end(const char *filename, FILE *out);
+void stats_report(FILE *out);
+
+#endif
@@ -0,0 +1,411 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Find the ELF files of directory trees, reading the directories in parallel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include "walk.h"
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    size_t file;     /* Index of a file in the files found */
+} Walk_Seen;
+
+typedef struct
+{
+    const Walk_Options *options;
+    dev_t dev;
+    char **dirs;     /* Directories waiting to be read */
+    size_t dirlen;
+    size_t dircap;
+    size_t busy;     /* Workers reading a directory, which may find others */
+    char **files;
+    size_t filelen;
+    size_t filecap;
+    Walk_Seen *seen; /* Directories already read and files found, since the links may lead to them again */
+    size_t seenlen;
+    size_t seencap;  /* A power of two */
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} Walk;
+
+static int push(char ***list, size_t *length, size_t *capacity, char *item)
+{
+    char **grown;
+
+    if (*length == *capacity)
+    {
+        const size_t newCapacity = *capacity == 0 ? 64 : *capacity * 2;
+        if ((grown = realloc(*list, sizeof(char*) * newCapacity)) == NULL)
+            return 0;
+        *list = grown;
+        *capacity = newCapacity;
+    }
+
+    (*list)[(*length)++] = item;
+    return 1;
+}
+
+static char* join(const char *path, const char *name)
+{
+    size_t len = strlen(path);
+    char *joined;
+
+    if ((joined = malloc(len + strlen(name) + 2)) == NULL)
+        return NULL;
+
+    strcpy(joined, path);
+    if (len == 0 || path[len - 1] != '/')
+        joined[len++] = '/';
+    strcpy(joined + len, name);
+
+    return joined;
+}
+
+static size_t seen_slot(const Walk_Seen *seen, size_t mask, const struct stat *stats)
+{
+    size_t slot = ((size_t)stats->st_dev * 31 + (size_t)stats->st_ino) & mask;
+
+    /* The inode 0 marks an empty slot, no filesystem gives it to a directory */
+    while (seen[slot].ino != 0 && (seen[slot].dev != stats->st_dev || seen[slot].ino != stats->st_ino))
+        slot = (slot + 1) & mask;
+
+    return slot;
+}
+
+/* Returns 1 the first time a directory or a file is seen, 0 after (giving the index of the file first found), -1 on failure */
+static int mark_seen(Walk *walk, const struct stat *stats, size_t file, size_t *first)
+{
+    Walk_Seen *grown;
+    size_t k, slot, capacity;
+
+    if (walk->seencap > 0 && walk->seen[slot = seen_slot(walk->seen, walk->seencap - 1, stats)].ino != 0)
+    {
+        if (first != NULL)
+            *first = walk->seen[slot].file;
+        return 0;
+    }
+
+    /* Keep the load factor under one half */
+    if ((walk->seenlen + 1) * 2 > walk->seencap)
+    {
+        capacity = walk->seencap == 0 ? 256 : walk->seencap * 2;
+        if ((grown = calloc(capacity, sizeof(Walk_Seen))) == NULL)
+            return -1;
+        for (k = 0; k < walk->seencap; k++)
+        {
+            if (walk->seen[k].ino != 0)
+            {
+                struct stat moved;
+
+                moved.st_dev = walk->seen[k].dev;
+                moved.st_ino = walk->seen[k].ino;
+                grown[seen_slot(grown, capacity - 1, &moved)] = walk->seen[k];
+            }
+        }
+        free(walk->seen);
+        walk->seen = grown;
+        walk->seencap = capacity;
+    }
+
+    slot = seen_slot(walk->seen, walk->seencap - 1, stats);
+    walk->seen[slot].dev = stats->st_dev;
+    walk->seen[slot].ino = stats->st_ino;
+    walk->seen[slot].file = file;
+    walk->seenlen++;
+
+    return 1;
+}
+
+/* The file is identified by its stats when the links are followed, so that it is found once */
+static void add_found(Walk *walk, char *path, int directory, const struct stat *stats)
+{
+    size_t first;
+    int added, seen;
+
+    pthread_mutex_lock(&walk->lock);
+    if (!directory && stats != NULL && (seen = mark_seen(walk, stats, walk->filelen, &first)) <= 0)
+    {
+        if (seen < 0)
+        {
+            fprintf(stderr, "Failed to allocate memory for the files found: %s!\n", strerror(errno));
+            walk->failed = 1;
+            free(path);
+        }
+        /* Keep the smallest of its paths, whichever worker finds it first */
+        else if (strcmp(path, walk->files[first]) < 0)
+        {
+            free(walk->files[first]);
+            walk->files[first] = path;
+        }
+        else
+            free(path);
+        pthread_mutex_unlock(&walk->lock);
+        return;
+    }
+    if (directory)
+        added = push(&walk->dirs, &walk->dirlen, &walk->dircap, path);
+    else
+        added = push(&walk->files, &walk->filelen, &walk->filecap, path);
+    if (!added)
+    {
+        fprintf(stderr, "Failed to allocate memory for the files found: %s!\n", strerror(errno));
+        walk->failed = 1;
+        free(path);
+    }
+    else if (directory)
+        pthread_cond_signal(&walk->ready);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static int is_elf(int dirfd, const char *name)
+{
+    unsigned char magic[SELFMAG];
+    int fd, rv;
+
+    /* The magic number is enough to skip the scripts and the data */
+    if ((fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY)) == -1)
+        return 0;
+    rv = pread(fd, magic, SELFMAG, 0) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+    close(fd);
+
+    return rv;
+}
+
+static unsigned char mode_type(mode_t mode)
+{
+    if (S_ISDIR(mode))
+        return DT_DIR;
+    if (S_ISREG(mode))
+        return DT_REG;
+    if (S_ISLNK(mode))
+        return DT_LNK;
+    return DT_UNKNOWN;
+}
+
+static void read_entry(Walk *walk, int dirfd, const char *path, const char *name, unsigned char type)
+{
+    struct stat stats;
+    char *joined;
+    int stated = 0;
+
+    /* Some filesystems don't fill the type of the entries */
+    if (type == DT_UNKNOWN)
+    {
+        if (fstatat(dirfd, name, &stats, AT_SYMLINK_NOFOLLOW) != 0)
+            return;
+        type = mode_type(stats.st_mode);
+        stated = 1;
+    }
+
+    /* A link stands for what it points to, or for nothing */
+    if (type == DT_LNK)
+    {
+        if (!walk->options->follow || fstatat(dirfd, name, &stats, 0) != 0)
+            return;
+        type = mode_type(stats.st_mode);
+        stated = 1;
+    }
+
+    if (type != DT_DIR && (type != DT_REG || !is_elf(dirfd, name)))
+        return;
+
+    /* The links may lead to a file found under another name */
+    if (walk->options->follow && type == DT_REG && !stated && fstatat(dirfd, name, &stats, 0) != 0)
+        return;
+
+    if ((joined = join(path, name)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the path: %s!\n", strerror(errno));
+        pthread_mutex_lock(&walk->lock);
+        walk->failed = 1;
+        pthread_mutex_unlock(&walk->lock);
+        return;
+    }
+    add_found(walk, joined, type == DT_DIR, walk->options->follow ? &stats : NULL);
+}
+
+static void read_directory(Walk *walk, const char *path)
+{
+    char buffer[32768];
+    struct stat stats;
+    ssize_t n, pos;
+    int fd, seen;
+
+    /* A directory that can't be read is skipped, like find does */
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    {
+        fprintf(stderr, "Failed to open the directory %s: %s!\n", path, strerror(errno));
+        return;
+    }
+
+    /* Stay on the filesystem of the root if asked, and read each directory once */
+    if (fstat(fd, &stats) != 0 || (walk->options->samefs && stats.st_dev != walk->dev))
+    {
+        close(fd);
+        return;
+    }
+    pthread_mutex_lock(&walk->lock);
+    if ((seen = mark_seen(walk, &stats, 0, NULL)) < 0)
+    {
+        fprintf(stderr, "Failed to allocate memory for the directories: %s!\n", strerror(errno));
+        walk->failed = 1;
+    }
+    pthread_mutex_unlock(&walk->lock);
+    if (seen <= 0)
+    {
+        close(fd);
+        return;
+    }
+
+    /* Read the whole directory, by large chunks */
+    while ((n = getdents64(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (pos = 0; pos < n; pos += ((struct dirent64*)(buffer + pos))->d_reclen)
+        {
+            const struct dirent64 *entry = (const struct dirent64*)(buffer + pos);
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            read_entry(walk, fd, path, entry->d_name, entry->d_type);
+        }
+    }
+    close(fd);
+}
+
+static void* worker(void *arg)
+{
+    Walk *walk = arg;
+    char *path;
+
+    pthread_mutex_lock(&walk->lock);
+    for (;;)
+    {
+        /* Wait for a directory, as long as the others may still find some */
+        while (walk->dirlen == 0 && walk->busy > 0 && !walk->failed)
+            pthread_cond_wait(&walk->ready, &walk->lock);
+        if (walk->dirlen == 0 || walk->failed)
+            break;
+
+        path = walk->dirs[--walk->dirlen];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        read_directory(walk, path);
+        free(path);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->busy--;
+    }
+
+    /* Nothing is left: wake up the others, so that they stop too */
+    pthread_cond_broadcast(&walk->ready);
+    pthread_mutex_unlock(&walk->lock);
+
+    return NULL;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+int walk_tree(const char *directory, const Walk_Options *options, unsigned int jobs, char ***files, size_t *count)
+{
+    Walk walk;
+    pthread_t *threads;
+    struct stat stats;
+    char *root;
+    size_t k, len, started = 0;
+    int rv = 0;
+
+    if (stat(directory, &stats) != 0)
+    {
+        fprintf(stderr, "Failed to read the directory %s: %s!\n", directory, strerror(errno));
+        return 3;
+    }
+    if (!S_ISDIR(stats.st_mode))
+    {
+        fprintf(stderr, "%s isn't a directory!\n", directory);
+        return 3;
+    }
+
+    /* Don't double the slashes of the paths found */
+    len = strlen(directory);
+    while (len > 1 && directory[len - 1] == '/')
+        len--;
+    if ((root = malloc(len + 1)) == NULL || (threads = malloc(sizeof(pthread_t) * jobs)) == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the traversal: %s!\n", strerror(errno));
+        free(root);
+        return 3;
+    }
+    sprintf(root, "%.*s", (int)len, directory);
+
+    memset(&walk, 0, sizeof(Walk));
+    walk.options = options;
+    walk.dev = stats.st_dev;
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.ready, NULL);
+
+    if (!push(&walk.dirs, &walk.dirlen, &walk.dircap, root))
+    {
+        fprintf(stderr, "Failed to allocate memory for the traversal: %s!\n", strerror(errno));
+        free(root);
+        rv = 3; goto RET;
+    }
+
+    /* Fewer workers only make the traversal slower */
+    for (k = 0; k < jobs; k++)
+    {
+        if (pthread_create(&threads[k], NULL, worker, &walk) != 0)
+            break;
+        started++;
+    }
+    if (started == 0)
+        worker(&walk);
+    for (k = 0; k < started; k++)
+        pthread_join(threads[k], NULL);
+
+    if (walk.failed)
+    {
+        rv = 3; goto RET;
+    }
+
+    /* The workers find the files in any order, give them in a stable one */
+    if (walk.filelen > 0)
+        qsort(walk.files, walk.filelen, sizeof(char*), compare_paths);
+
+    *files = walk.files;
+    *count = walk.filelen;
+    walk.files = NULL;
+    walk.filelen = 0;
+
+  RET:
+    for (k = 0; k < walk.dirlen; k++)
+        free(walk.dirs[k]);
+    for (k = 0; k < walk.filelen; k++)
+        free(walk.files[k]);
+    free(walk.dirs);
+    free(walk.files);
+    free(walk.seen);
+    free(threads);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.ready);
+
+    return rv;
+}
@@ -0,0 +1,21 @@
+/*
+ * Author: Matthieu Carteron <rubisetcie@gmail.com>
+ * date:   2024-07-17
+ *
+ * Find the ELF files of directory trees, reading the directories in parallel.
+ */
+
+#ifndef WALK_H_INCLUDED
+#define WALK_H_INCLUDED
+
+#include <stddef.h>
+
+typedef struct
+{
+    int follow; /* Follow the symbolic links, to the files and to the directories */
+    int samefs; /* Don't descend into the directories of other filesystems */
+} Walk_Options;
+
+int walk_tree(const char *directory, const Walk_Options *options, unsigned int jobs, char ***files, size_t *count);
+
+#endif